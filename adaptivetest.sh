@@ -0,0 +1,35 @@
+# Bash script checking -adaptive against full supersampling
+#!/bin/bash
+
+# The top edge of the rectangle lies on the border between two leaves,
+# and each leaf alone looks flat. With 4 samples per pixel, -adaptive
+# takes them all wherever it does not take a single one, so both images
+# must be the same.
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cat > $dir/boundary.rvg <<'RVG'
+local rvg = {}
+
+-- the small square makes the tree split at y = 32
+rvg.scene = scene{
+  fill(path{M,-10,-10,80,-10,80,32,-10,32,Z}, rgb8(0,0,0)),
+  fill(path{M,2,50,4,50,4,52,2,52,Z}, rgb8(0,0,0)),
+}
+
+rvg.window = window(0,0,64,64)
+
+rvg.viewport = viewport(0,0,64,64)
+
+return rvg
+RVG
+
+options="-pattern:4 -radius:1 -maxseg:0 -maxcost:0 -maxdepth:2"
+lua process.lua -quiet driver.cpp.png $dir/boundary.rvg $dir/full.png $options
+lua process.lua -quiet driver.cpp.png $dir/boundary.rvg $dir/adaptive.png \
+    $options -adaptive:0
+if cmp -s $dir/full.png $dir/adaptive.png; then
+    echo "adaptive: ok"
+else
+    echo "adaptive: images differ"
+    exit 1
+fi
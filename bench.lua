@@ -0,0 +1,486 @@
+local unpack = unpack or table.unpack
+
+local chronos = require"chronos"
+
+local quiet = false
+
+local function stderr(...)
+    if not quiet then
+        io.stderr:write(string.format(...))
+    end
+end
+
+-- print help and exit
+local function help()
+    io.stderr:write([=[
+Usage:
+  lua bench.lua [options] [<input.rvg>...]
+times accelerate, render and store for each driver on each scene, at
+each size and number of samples. Without inputs, the shipped scenes and
+a procedurally generated corpus are used.
+where options are:
+  -drivers:<d1>,<d2>...  drivers to time (default driver.cpp.png,
+                         driver.cpp.svg, driver.cpp.cpp, driver.lua.png,
+                         driver.lua.png2, driver.lua.png3, driver.lua.png4)
+  -sizes:<n1>,<n2>...    viewport widths (default 256,1024)
+  -samples:<n1>,<n2>...  blue noise patterns for png drivers (default 1,8)
+  -repeat:<n>            runs of each measurement, keeping the fastest (3)
+  -dir:<dir>             where the corpus and outputs go (default bench)
+  -save:<file>           write results to <file>
+  -baseline:<file>       compare results with those saved in <file>
+  -full                  also time Lua drivers beyond the first size and
+                         sample count, and on the large scenes
+  -quiet                 print only the results
+Options not listed are passed down to every driver.
+]=])
+    os.exit()
+end
+
+local function list(s, convert)
+    local t = {}
+    for v in string.gmatch(s, "[^,]+") do
+        t[#t+1] = assert(convert(v), "invalid list " .. s)
+    end
+    assert(#t > 0, "empty list")
+    return t
+end
+
+local drivernames = { "driver.cpp.png", "driver.cpp.svg", "driver.cpp.cpp",
+    "driver.lua.png", "driver.lua.png2", "driver.lua.png3",
+    "driver.lua.png4" }
+local sizes = { 256, 1024 }
+local samples = { 1, 8 }
+local repeats = 3
+local dir = "bench"
+local savename, baselinename
+local full = false
+
+-- list of supported options, as in process.lua
+local options = {
+    { "^%-help$", function(w)
+        if w then
+            help()
+            return true
+        else
+            return false
+        end
+    end },
+    { "^%-quiet$", function(d)
+        if not d then return false end
+        quiet = true
+        return true
+    end },
+    { "^%-full$", function(d)
+        if not d then return false end
+        full = true
+        return true
+    end },
+    { "^%-drivers%:(.+)$", function(l)
+        if not l then return false end
+        drivernames = list(l, tostring)
+        return true
+    end },
+    { "^%-sizes%:(.+)$", function(l)
+        if not l then return false end
+        sizes = list(l, tonumber)
+        return true
+    end },
+    { "^%-samples%:(.+)$", function(l)
+        if not l then return false end
+        samples = list(l, tonumber)
+        return true
+    end },
+    { "^(%-repeat%:(%d+)(.*))$", function(all, n, e)
+        if not n then return false end
+        assert(e == "", "invalid option " .. all)
+        repeats = assert(tonumber(n), "invalid option " .. all)
+        assert(repeats >= 1, "invalid option " .. all)
+        return true
+    end },
+    { "^%-dir%:(.+)$", function(d)
+        if not d then return false end
+        dir = d
+        return true
+    end },
+    { "^%-save%:(.+)$", function(o)
+        if not o then return false end
+        savename = o
+        return true
+    end },
+    { "^%-baseline%:(.+)$", function(o)
+        if not o then return false end
+        baselinename = o
+        return true
+    end },
+}
+
+-- rejected options are passed to drivers
+local rejected = {}
+local inputs = {}
+for i, argument in ipairs({...}) do
+    if argument:sub(1,1) == "-" then
+        local recognized = false
+        for j, option in ipairs(options) do
+            if option[2](argument:match(option[1])) then
+                recognized = true
+                break
+            end
+        end
+        if not recognized then
+            rejected[#rejected+1] = argument
+        end
+    else
+        inputs[#inputs+1] = argument
+    end
+end
+
+os.execute('mkdir -p "' .. dir .. '"')
+
+-- Park-Miller generator, so that every Lua version generates the same
+-- corpus
+local seed = 1
+local function random(a, b)
+    seed = (seed*16807) % 2147483647
+    return a + (b-a)*seed/2147483647
+end
+
+local function color()
+    return string.format("rgba8(%d,%d,%d,%d)", math.floor(random(0, 256)),
+        math.floor(random(0, 256)), math.floor(random(0, 256)),
+        math.floor(random(64, 256)))
+end
+
+local function point(t, xmin, ymin, xmax, ymax)
+    t[#t+1] = string.format("%.2f,%.2f", random(xmin, xmax),
+        random(ymin, ymax))
+end
+
+-- Scenes are 1024 units wide, and scaled to each viewport size
+local generators = {}
+
+-- many small shapes, each covering only a few leaves
+function generators.small(f)
+    for i = 1, 20000 do
+        local x, y = random(0, 1024), random(0, 1024)
+        local k = i % 3
+        if k == 0 then
+            f:write(string.format("  fill(circle(%.2f,%.2f,%.2f),%s),\n",
+                x, y, random(1, 6), color()))
+        elseif k == 1 then
+            f:write(string.format("  fill(rect(%.2f,%.2f,%.2f,%.2f),%s),\n",
+                x, y, random(1, 10), random(1, 10), color()))
+        else
+            local t = {}
+            for j = 1, 3 do point(t, x-8, y-8, x+8, y+8) end
+            f:write(string.format("  fill(triangle(%s),%s),\n",
+                table.concat(t, ","), color()))
+        end
+    end
+end
+
+-- a few paths with a huge number of segments each
+function generators.huge(f)
+    for i = 1, 3 do
+        local cx, cy = random(300, 724), random(300, 724)
+        local t = {}
+        local n = 20000
+        for j = 0, n-1 do
+            local a = 2*math.pi*j/n
+            local r = random(150, 350)
+            t[#t+1] = string.format("%.2f,%.2f", cx + r*math.cos(a),
+                cy + r*math.sin(a))
+        end
+        f:write(string.format("  eofill(path{M,%s,L,%s,Z},%s),\n", t[1],
+            table.concat(t, ",", 2), color()))
+    end
+end
+
+-- long paths made only of cubics
+function generators.cubics(f)
+    for i = 1, 2000 do
+        local x, y = random(0, 1024), random(0, 1024)
+        local t = {}
+        for j = 1, 20*3 do point(t, x-60, y-60, x+60, y+60) end
+        f:write(string.format("  fill(path{M,%.2f,%.2f,C,%s,Z},%s),\n",
+            x, y, table.concat(t, ","), color()))
+    end
+end
+
+local function ramp()
+    local spreads = { "pad", '["repeat"]', "reflect", "transparent" }
+    local s = spreads[math.floor(random(1, 5))]
+    if s:sub(1,1) ~= "[" then s = "." .. s end
+    return string.format("ramp(spread%s,{{0,%s},{0.3,%s},{0.7,%s},{1,%s}})",
+        s, color(), color(), color(), color())
+end
+
+-- overlapping gradients of every kind
+function generators.gradients(f)
+    for i = 1, 1000 do
+        local x, y = random(0, 1024), random(0, 1024)
+        local r = random(10, 120)
+        if i % 2 == 0 then
+            f:write(string.format("  fill(circle(%.2f,%.2f,%.2f)," ..
+                "linear_gradient(%s,%.2f,%.2f,%.2f,%.2f)),\n", x, y, r,
+                ramp(), x-r, y, x+r, y+r/2))
+        else
+            f:write(string.format("  fill(rect(%.2f,%.2f,%.2f,%.2f)," ..
+                "radial_gradient(%s,%.2f,%.2f,%.2f,%.2f,%.2f)),\n",
+                x-r, y-r, 2*r, 2*r, ramp(), x, y, x+r/3, y, r))
+        end
+    end
+end
+
+-- stroked polylines, some of them dashed
+function generators.strokes(f)
+    local joins = { "round", "miter_clip", "bevel" }
+    for i = 1, 2000 do
+        local x, y = random(0, 1024), random(0, 1024)
+        local t = {}
+        for j = 1, 12 do point(t, x-80, y-80, x+80, y+80) end
+        local dash = ""
+        if i % 3 == 0 then
+            dash = string.format(":dashed{%.1f,%.1f}", random(2, 12),
+                random(2, 12))
+        end
+        f:write(string.format("  fill(path{M,%.2f,%.2f,L,%s}:stroked(%.2f)" ..
+            ":joined(join.%s)%s,%s),\n", x, y, table.concat(t, ","),
+            random(.5, 6), joins[i % 3 + 1], dash, color()))
+    end
+end
+
+-- textured shapes, with the texture rendered by the png driver itself
+local function texture_data()
+    local name = dir .. "/texture.rvg"
+    local f = assert(io.open(name, "w"))
+    f:write("local rvg = {}\nrvg.scene = scene{\n")
+    generators.gradients(f)
+    f:write("}\nrvg.window = window(0,0,1024,1024)\n")
+    f:write("rvg.viewport = viewport(0,0,256,256)\nreturn rvg\n")
+    f:close()
+    local png = dir .. "/texture.png"
+    assert(os.execute('lua process.lua -quiet driver.cpp.png "' .. name ..
+        '" "' .. png .. '"'), "unable to render texture")
+    f = assert(io.open(png, "rb"))
+    local data = f:read("*a")
+    f:close()
+    return require"base64".encode(data)
+end
+
+function generators.textures(f)
+    local spreads = { "pad", '["repeat"]', "reflect" }
+    f:write("  -- texture shared by every element\n")
+    local data = texture_data()
+    for i = 1, 300 do
+        local x, y = random(0, 1024), random(0, 1024)
+        local r = random(20, 200)
+        local s = spreads[i % 3 + 1]
+        if s:sub(1,1) ~= "[" then s = "." .. s end
+        -- textures cover the unit square
+        f:write(string.format("  fill(rect(%.2f,%.2f,%.2f,%.2f)," ..
+            "texture(spread%s,tex):scaled(%.2f):translated(%.2f,%.2f)),\n",
+            x-r, y-r, 2*r, 2*r, s, 2*r, x-r, y-r))
+    end
+    return data
+end
+
+-- scenes too large for the Lua drivers unless -full is given
+local large = { small = true, huge = true, cubics = true, strokes = true,
+    textures = true }
+
+local function generate(name)
+    local path = dir .. "/" .. name .. ".rvg"
+    seed = 1
+    local body = {}
+    local sink = { write = function(self, ...)
+        for i, s in ipairs({...}) do body[#body+1] = s end
+    end }
+    local data = generators[name](sink)
+    local f = assert(io.open(path, "w"))
+    f:write("-- generated by bench.lua\nlocal rvg = {}\n")
+    if data then
+        f:write("local tex = image.png.load(base64.decode[[\n", data, "]])\n")
+    end
+    f:write("rvg.scene = scene{\n", table.concat(body))
+    f:write("}\nrvg.window = window(0,0,1024,1024)\n")
+    f:write("rvg.viewport = viewport(0,0,1024,1024)\nreturn rvg\n")
+    f:close()
+    return path
+end
+
+local scenes = {}
+if #inputs > 0 then
+    for i, name in ipairs(inputs) do
+        scenes[#scenes+1] = { name = name:match("([^/]*)%.rvg$") or name,
+            path = name }
+    end
+else
+    scenes[1] = { name = "trigleo", path = "driver/trigleo.rvg" }
+    for i, name in ipairs{ "small", "huge", "cubics", "gradients",
+        "strokes", "textures" } do
+        stderr("generating %s\n", name)
+        scenes[#scenes+1] = { name = name, path = generate(name),
+            large = large[name] }
+    end
+end
+
+local function isluadriver(name)
+    return name:match("^driver%.lua%.") ~= nil
+end
+
+local function ispngdriver(name)
+    return name:match("png%d*$") ~= nil
+end
+
+-- sum of the saving times of every frame in a -times report, which
+-- has a header and then tx, ty, culling, rendering and saving per line
+local function savingtime(name)
+    local f = io.open(name, "r")
+    if not f then return nil end
+    local total
+    for line in f:lines() do
+        local t = line:match(
+            "^[^\t]+\t[^\t]+\t[^\t]+\t[^\t]+\t([%d%.eE+-]+)$")
+        if t then total = (total or 0) + tonumber(t) end
+    end
+    f:close()
+    return total
+end
+
+-- times one combination, returning the fastest of several runs of each
+-- phase. The render phase includes the output the driver writes as it
+-- goes. Store is the part of that the png driver reports as saving, or
+-- the final flush and close for other drivers.
+local function measure(driver, drivername, scene, size, spp)
+    local env = driver
+    local input
+    if _VERSION == "Lua 5.1" then
+        input = assert(setfenv(assert(loadfile(scene.path)), env)())
+    else
+        input = assert(assert(loadfile(scene.path, "bt", env))())
+    end
+    local vxmin, vymin, vxmax, vymax = unpack(input.viewport)
+    local height = math.max(1,
+        math.floor((vymax-vymin)*size/(vxmax-vxmin)+0.5))
+    local viewport = driver.viewport(0, 0, size, height)
+    local s = input.scene:windowviewport(input.window, viewport)
+    local args = {}
+    for i, v in ipairs(rejected) do args[i] = v end
+    local times
+    if ispngdriver(drivername) and spp > 1 then
+        args[#args+1] = "-pattern:" .. spp
+    end
+    if drivername == "driver.cpp.png" then
+        -- -times rather than -stats, which counts work as it renders
+        times = dir .. "/times.tsv"
+        args[#args+1] = "-times:" .. times
+    end
+    local ext = ispngdriver(drivername) and "png" or
+        drivername:match("([^.]*)$")
+    local output = string.format("%s/%s-%s-%d-%d.%s", dir, scene.name,
+        drivername:gsub("%.", "_"), size, spp, ext)
+    local best = {}
+    local time = chronos.chronos()
+    for r = 1, repeats do
+        collectgarbage()
+        time:reset()
+        local accel = driver.accelerate(s, viewport, args)
+        local a = time:elapsed()
+        local file = assert(io.open(output, "wb"))
+        time:reset()
+        driver.render(accel, viewport, file, args)
+        local rendered = time:elapsed()
+        time:reset()
+        file:close()
+        local st = time:elapsed()
+        local saving = times and savingtime(times)
+        if saving then
+            rendered = rendered - saving
+            st = st + saving
+        end
+        best.accelerate = math.min(best.accelerate or a, a)
+        best.render = math.min(best.render or rendered, rendered)
+        best.store = math.min(best.store or st, st)
+        accel = nil
+    end
+    return best
+end
+
+local function key(r)
+    return table.concat({ r.scene, r.driver, r.size, r.samples }, "\t")
+end
+
+local baseline = {}
+if baselinename then
+    for line in io.lines(baselinename) do
+        local sc, dr, sz, sp, a, r, st = line:match(
+            "^([^\t]+)\t([^\t]+)\t(%d+)\t(%d+)\t([^\t]+)\t([^\t]+)\t([^\t]+)$")
+        if sc then
+            baseline[table.concat({ sc, dr, sz, sp }, "\t")] = {
+                accelerate = tonumber(a), render = tonumber(r),
+                store = tonumber(st) }
+        end
+    end
+end
+
+local function ratio(new, old)
+    if not old or old <= 0 then return "" end
+    return string.format(" (%.2fx)", new/old)
+end
+
+io.stdout:write(string.format("%-10s %-16s %5s %4s %-18s %-18s %-18s\n",
+    "scene", "driver", "size", "spp", "accelerate", "render", "store"))
+
+local results = {}
+for i, drivername in ipairs(drivernames) do
+    local ok, driver = pcall(require, drivername)
+    if not ok then
+        stderr("skipping %s: %s\n", drivername, tostring(driver))
+    else
+        local lua = isluadriver(drivername)
+        for j, scene in ipairs(scenes) do
+            for k, size in ipairs(sizes) do
+                -- samples only matter to the png drivers
+                local counts = ispngdriver(drivername) and samples or
+                    { samples[1] }
+                for l, spp in ipairs(counts) do
+                    if not lua or full or
+                        (k == 1 and l == 1 and not scene.large) then
+                        stderr("%s %s %d %d\n", scene.name, drivername,
+                            size, spp)
+                        local r = { scene = scene.name, driver = drivername,
+                            size = size, samples = spp }
+                        local ok, t = pcall(measure, driver, drivername,
+                            scene, size, spp)
+                        local line = string.format("%-10s %-16s %5d %4d ",
+                            scene.name, drivername, size, spp)
+                        if ok then
+                            r.accelerate = t.accelerate
+                            r.render = t.render
+                            r.store = t.store
+                            results[#results+1] = r
+                            local b = baseline[key(r)] or {}
+                            line = line .. string.format(
+                                "%9.4f%-9s %9.4f%-9s %9.4f%-9s",
+                                t.accelerate, ratio(t.accelerate, b.accelerate),
+                                t.render, ratio(t.render, b.render),
+                                t.store, ratio(t.store, b.store))
+                        else
+                            line = line .. "failed: " .. tostring(t)
+                        end
+                        io.stdout:write(line, "\n")
+                    end
+                end
+            end
+        end
+    end
+end
+
+if savename then
+    local f = assert(io.open(savename, "w"))
+    for i, r in ipairs(results) do
+        f:write(string.format("%s\t%.6f\t%.6f\t%.6f\n", key(r),
+            r.accelerate, r.render, r.store))
+    end
+    f:close()
+end
@@ -0,0 +1,64 @@
+#ifndef RVG_DRIVER_PNG_ARRAY_H
+#define RVG_DRIVER_PNG_ARRAY_H
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace rvg {
+    namespace driver {
+        namespace png {
+
+// Read-only contiguous array that either owns its elements or refers to
+// memory owned by someone else, such as a mapped cache file
+template <typename T>
+class Array {
+    std::vector<T> m_owned;
+    const T *m_data;
+    size_t m_size;
+public:
+    Array(void): m_data(nullptr), m_size(0) { ; }
+
+    explicit Array(std::vector<T> &&owned):
+        m_owned(std::move(owned)),
+        m_data(m_owned.data()),
+        m_size(m_owned.size())
+        { ; }
+
+    Array(const T *data, size_t size):
+        m_data(data),
+        m_size(size)
+        { ; }
+
+    // moving a vector keeps its buffer, so m_data remains valid
+    Array(Array &&other) noexcept:
+        m_owned(std::move(other.m_owned)),
+        m_data(other.m_data),
+        m_size(other.m_size) {
+        other.m_data = nullptr;
+        other.m_size = 0;
+    }
+
+    Array &operator=(Array &&other) noexcept {
+        m_owned = std::move(other.m_owned);
+        m_data = other.m_data;
+        m_size = other.m_size;
+        other.m_data = nullptr;
+        other.m_size = 0;
+        return *this;
+    }
+
+    Array(const Array &) = delete;
+    Array &operator=(const Array &) = delete;
+
+    const T &operator[](size_t i) const { return m_data[i]; }
+    const T *data(void) const { return m_data; }
+    size_t size(void) const { return m_size; }
+    bool empty(void) const { return m_size == 0; }
+    const T *begin(void) const { return m_data; }
+    const T *end(void) const { return m_data + m_size; }
+};
+
+} } } // namespace rvg::driver::png
+
+#endif
@@ -0,0 +1,211 @@
+#ifndef RVG_DRIVER_PNG_BAND_H
+#define RVG_DRIVER_PNG_BAND_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "color/color.h"
+
+#include "driver/cpp/dither.h"
+
+namespace rvg {
+    namespace driver {
+        namespace png {
+
+// Bits per channel of the framebuffer pixels are rendered into
+enum class Precision {
+    f32,    // 16 bytes per pixel
+    f16,    // 8 bytes per pixel, IEEE half floats
+    u8      // 4 bytes per pixel, quantized as soon as they are rendered
+};
+
+// IEEE half float, rounded to nearest even
+inline uint16_t float_to_half(float f) {
+    uint32_t x;
+    std::memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000u;
+    uint32_t abs = x & 0x7fffffffu;
+    // infinities and nans, keeping nans quiet
+    if (abs >= 0x7f800000u) {
+        return static_cast<uint16_t>(sign | 0x7c00u |
+            (abs > 0x7f800000u? 0x200u: 0u));
+    }
+    // anything from 65520 up rounds to infinity
+    if (abs >= 0x477ff000u) return static_cast<uint16_t>(sign | 0x7c00u);
+    // below 2^-14, in units of 2^-24 (scaling by 2^24 is exact)
+    if (abs < 0x38800000u) {
+        float a;
+        std::memcpy(&a, &abs, sizeof(a));
+        return static_cast<uint16_t>(sign |
+            static_cast<uint32_t>(std::nearbyint(a*16777216.f)));
+    }
+    // rebias the exponent from 127 to 15 and round the mantissa
+    uint32_t r = abs - 0x38000000u;
+    r += 0xfffu + ((r >> 13) & 1u);
+    return static_cast<uint16_t>(sign | (r >> 13));
+}
+
+inline float half_to_float(uint16_t h) {
+    uint32_t sign = static_cast<uint32_t>(h & 0x8000u) << 16;
+    uint32_t e = (h >> 10) & 0x1fu, m = h & 0x3ffu;
+    if (e == 0) {
+        float f = static_cast<float>(m)*(1.f/16777216.f);
+        return sign? -f: f;
+    }
+    uint32_t x = sign | (e == 31? 0x7f800000u: (e+112u) << 23) | (m << 13);
+    float f;
+    std::memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+// Consecutive rows of an image being rendered, as RGBA pixels stored
+// with the given precision. Rows go up, as in rvg images. Whatever the
+// precision, colors are quantized to 8 bits once, with the dither mask.
+class Band {
+    int m_width, m_first, m_rows;
+    Precision m_precision;
+    const DitherMask *m_dither;
+    std::vector<float> m_f32;
+    std::vector<uint16_t> m_f16;
+    std::vector<uint8_t> m_u8;
+
+    size_t index(int j, int i) const {
+        return 4*(static_cast<size_t>(i-m_first)*m_width + j);
+    }
+
+public:
+    explicit Band(Precision precision = Precision::f32,
+        const DitherMask *dither = nullptr):
+        m_width(0), m_first(0), m_rows(0),
+        m_precision(precision),
+        m_dither(dither) { ; }
+
+    // Reuses the storage for rows [first, first+rows)
+    void reset(int width, int first, int rows) {
+        m_width = width;
+        m_first = first;
+        m_rows = rows;
+        size_t n = 4*static_cast<size_t>(width)*rows;
+        switch (m_precision) {
+            case Precision::f32: m_f32.resize(n); break;
+            case Precision::f16: m_f16.resize(n); break;
+            case Precision::u8: m_u8.resize(n); break;
+        }
+    }
+
+    int first(void) const { return m_first; }
+    int rows(void) const { return m_rows; }
+
+    // Column j of image row i
+    void set_pixel(int j, int i, float r, float g, float b, float a) {
+        size_t k = index(j, i);
+        switch (m_precision) {
+            case Precision::f32: {
+                float *p = &m_f32[k];
+                p[0] = r; p[1] = g; p[2] = b; p[3] = a;
+                break;
+            }
+            case Precision::f16: {
+                uint16_t *p = &m_f16[k];
+                p[0] = float_to_half(r); p[1] = float_to_half(g);
+                p[2] = float_to_half(b); p[3] = float_to_half(a);
+                break;
+            }
+            case Precision::u8: {
+                uint8_t *p = &m_u8[k];
+                p[0] = quantize(m_dither, j, i, r);
+                p[1] = quantize(m_dither, j, i, g);
+                p[2] = quantize(m_dither, j, i, b);
+                p[3] = color::unorm_to_uint8_t(a);
+                break;
+            }
+        }
+    }
+
+    // Sets columns [j0,j1) of rows [i0,i1) to the same color, converting
+    // it only once unless it has to be dithered
+    void fill(int j0, int j1, int i0, int i1, float r, float g, float b,
+        float a) {
+        switch (m_precision) {
+            case Precision::f32: {
+                const float c[4] = {r, g, b, a};
+                for (int i = i0; i < i1; ++i) {
+                    float *p = &m_f32[index(j0, i)];
+                    for (int j = j0; j < j1; ++j, p += 4) {
+                        std::memcpy(p, c, sizeof(c));
+                    }
+                }
+                break;
+            }
+            case Precision::f16: {
+                const uint16_t c[4] = {float_to_half(r), float_to_half(g),
+                    float_to_half(b), float_to_half(a)};
+                for (int i = i0; i < i1; ++i) {
+                    uint16_t *p = &m_f16[index(j0, i)];
+                    for (int j = j0; j < j1; ++j, p += 4) {
+                        std::memcpy(p, c, sizeof(c));
+                    }
+                }
+                break;
+            }
+            case Precision::u8: {
+                if (m_dither) {
+                    for (int i = i0; i < i1; ++i) {
+                        for (int j = j0; j < j1; ++j) {
+                            set_pixel(j, i, r, g, b, a);
+                        }
+                    }
+                    break;
+                }
+                const uint8_t c[4] = {quantize(nullptr, 0, 0, r),
+                    quantize(nullptr, 0, 0, g), quantize(nullptr, 0, 0, b),
+                    color::unorm_to_uint8_t(a)};
+                for (int i = i0; i < i1; ++i) {
+                    uint8_t *p = &m_u8[index(j0, i)];
+                    for (int j = j0; j < j1; ++j, p += 4) {
+                        std::memcpy(p, c, sizeof(c));
+                    }
+                }
+                break;
+            }
+        }
+    }
+
+    // Image row i as 8-bit RGBA
+    void get_row(int i, uint8_t *rgba) const {
+        size_t k = index(0, i), n = 4*static_cast<size_t>(m_width);
+        switch (m_precision) {
+            case Precision::f32:
+                for (size_t c = 0; c < n; c += 4) {
+                    const float *p = &m_f32[k+c];
+                    int j = static_cast<int>(c/4);
+                    rgba[c] = quantize(m_dither, j, i, p[0]);
+                    rgba[c+1] = quantize(m_dither, j, i, p[1]);
+                    rgba[c+2] = quantize(m_dither, j, i, p[2]);
+                    rgba[c+3] = color::unorm_to_uint8_t(p[3]);
+                }
+                break;
+            case Precision::f16:
+                for (size_t c = 0; c < n; c += 4) {
+                    const uint16_t *p = &m_f16[k+c];
+                    int j = static_cast<int>(c/4);
+                    rgba[c] = quantize(m_dither, j, i, half_to_float(p[0]));
+                    rgba[c+1] = quantize(m_dither, j, i,
+                        half_to_float(p[1]));
+                    rgba[c+2] = quantize(m_dither, j, i,
+                        half_to_float(p[2]));
+                    rgba[c+3] = color::unorm_to_uint8_t(half_to_float(p[3]));
+                }
+                break;
+            case Precision::u8:
+                std::memcpy(rgba, &m_u8[k], n);
+                break;
+        }
+    }
+};
+
+} } } // namespace rvg::driver::png
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef RVG_DRIVER_PNG_BLUR_H
+#define RVG_DRIVER_PNG_BLUR_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace rvg {
+    namespace driver {
+        namespace png {
+
+// Three box filters in a row approximate a Gaussian closely enough for
+// blurs. These are their radii for standard deviation sigma, after
+// "Fast Almost-Gaussian Filtering" (Kovesi, 2010).
+inline void gaussian_boxes(float sigma, int radii[3]) {
+    const int n = 3;
+    float ideal = std::sqrt(12.f*sigma*sigma/n + 1.f);
+    int lo = static_cast<int>(std::floor(ideal));
+    if (lo % 2 == 0) --lo;
+    lo = std::max(lo, 1);
+    int hi = lo + 2;
+    float m = (12.f*sigma*sigma - n*lo*lo - 4.f*n*lo - 3.f*n)/
+        (-4.f*lo - 4.f);
+    int first_hi = static_cast<int>(std::lround(m));
+    for (int i = 0; i < n; ++i) {
+        radii[i] = ((i < first_hi? lo: hi) - 1)/2;
+    }
+}
+
+namespace detail {
+
+// Box filter of radius r along each row of a w x h RGBA image, with
+// transparent pixels beyond the borders. A running sum over the four
+// channels makes the cost independent of r.
+inline void box_rows(const float *in, float *out, int w, int h, int r) {
+    float norm = 1.f/static_cast<float>(2*r+1);
+    for (int i = 0; i < h; ++i) {
+        const float *row = in + 4*static_cast<size_t>(i)*w;
+        float *dst = out + 4*static_cast<size_t>(i)*w;
+        float sum[4] = {0.f, 0.f, 0.f, 0.f};
+        for (int j = 0; j < std::min(r, w); ++j) {
+            for (int c = 0; c < 4; ++c) sum[c] += row[4*j+c];
+        }
+        for (int j = 0; j < w; ++j) {
+            if (j+r < w) {
+                for (int c = 0; c < 4; ++c) sum[c] += row[4*(j+r)+c];
+            }
+            for (int c = 0; c < 4; ++c) dst[4*j+c] = sum[c]*norm;
+            if (j-r >= 0) {
+                for (int c = 0; c < 4; ++c) sum[c] -= row[4*(j-r)+c];
+            }
+        }
+    }
+}
+
+// Same along columns. Whole rows are added and subtracted at a time, so
+// the inner loops run over contiguous memory and vectorize.
+inline void box_columns(const float *in, float *out, int w, int h, int r,
+    std::vector<float> &sum) {
+    size_t n = 4*static_cast<size_t>(w);
+    float norm = 1.f/static_cast<float>(2*r+1);
+    sum.assign(n, 0.f);
+    for (int i = 0; i < std::min(r, h); ++i) {
+        const float *row = in + n*i;
+        for (size_t k = 0; k < n; ++k) sum[k] += row[k];
+    }
+    for (int i = 0; i < h; ++i) {
+        if (i+r < h) {
+            const float *row = in + n*(i+r);
+            for (size_t k = 0; k < n; ++k) sum[k] += row[k];
+        }
+        float *dst = out + n*i;
+        for (size_t k = 0; k < n; ++k) dst[k] = sum[k]*norm;
+        if (i-r >= 0) {
+            const float *row = in + n*(i-r);
+            for (size_t k = 0; k < n; ++k) sum[k] -= row[k];
+        }
+    }
+}
+
+} // namespace detail
+
+// Blurs a w x h premultiplied RGBA image in place with a Gaussian of
+// standard deviation sigma, in pixels
+inline void gaussian_blur(std::vector<float> &img, int w, int h,
+    float sigma) {
+    if (!(sigma > 0.f) || w <= 0 || h <= 0) return;
+    int radii[3];
+    gaussian_boxes(sigma, radii);
+    std::vector<float> tmp(img.size()), sum;
+    for (int r: radii) {
+        if (r <= 0) continue;
+        detail::box_rows(img.data(), tmp.data(), w, h, r);
+        detail::box_columns(tmp.data(), img.data(), w, h, r, sum);
+    }
+}
+
+} } } // namespace rvg::driver::png
+
+#endif
@@ -0,0 +1,459 @@
+#ifndef RVG_DRIVER_PNG_CACHE_H
+#define RVG_DRIVER_PNG_CACHE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "path/path.h"
+#include "shape/shape.h"
+#include "stroke/style.h"
+#include "xform/xform.h"
+
+#include "driver/cpp/png.h"
+#include "driver/cpp/texture.h"
+
+namespace rvg {
+    namespace driver {
+        namespace png {
+
+// Cache files hold an Accelerated object exactly as it is laid out in
+// memory, so that it can be mapped and used in place. Everything in it
+// refers to everything else by index, never by pointer. Bump the version
+// whenever the layout of any of the stored types changes.
+constexpr uint32_t cache_version = 5;
+
+// 64-bit FNV-1a hash
+class Hasher {
+    uint64_t m_hash;
+public:
+    Hasher(void): m_hash(UINT64_C(14695981039346656037)) { ; }
+
+    void add(const void *data, size_t size) {
+        const unsigned char *p = reinterpret_cast<const unsigned char *>(data);
+        for (size_t i = 0; i < size; ++i) {
+            m_hash = (m_hash ^ p[i])*UINT64_C(1099511628211);
+        }
+    }
+
+    template <typename T>
+    void add(const T &value) {
+        static_assert(std::is_arithmetic<T>::value || std::is_enum<T>::value,
+            "hash fields one by one, never padding");
+        add(&value, sizeof(T));
+    }
+
+    uint64_t value(void) const { return m_hash; }
+};
+
+// The functions below feed what they hash to H, a Hasher or anything
+// else with the same add methods.
+
+// Feeds every instruction of a path, with its coordinates, to H
+template <typename H>
+class PathHasher final: public path::IPath<PathHasher<H>> {
+    H &m_h;
+public:
+    explicit PathHasher(H &h): m_h(h) { ; }
+
+private:
+    friend path::IPath<PathHasher<H>>;
+
+    // instructions are told apart by a tag, so that their coordinates
+    // never run into each other
+    void add(int tag, std::initializer_list<float> values) {
+        m_h.add(tag);
+        for (float v: values) m_h.add(v);
+    }
+
+    void do_begin_closed_contour(uint16_t len, float x0, float y0) {
+        m_h.add(len);
+        add(0, {x0, y0});
+    }
+
+    void do_begin_open_contour(uint16_t len, float x0, float y0) {
+        m_h.add(len);
+        add(1, {x0, y0});
+    }
+
+    void do_end_open_contour(float x0, float y0, uint16_t len) {
+        m_h.add(len);
+        add(2, {x0, y0});
+    }
+
+    void do_end_closed_contour(float x0, float y0, uint16_t len) {
+        m_h.add(len);
+        add(3, {x0, y0});
+    }
+
+    void do_linear_segment(float x0, float y0, float x1, float y1) {
+        add(4, {x0, y0, x1, y1});
+    }
+
+    void do_quadratic_segment(float x0, float y0, float x1, float y1,
+        float x2, float y2) {
+        add(5, {x0, y0, x1, y1, x2, y2});
+    }
+
+    void do_rational_quadratic_segment(float x0, float y0, float x1, float y1,
+        float w1, float x2, float y2) {
+        add(6, {x0, y0, x1, y1, w1, x2, y2});
+    }
+
+    void do_cubic_segment(float x0, float y0, float x1, float y1,
+        float x2, float y2, float x3, float y3) {
+        add(7, {x0, y0, x1, y1, x2, y2, x3, y3});
+    }
+
+    void do_degenerate_segment(float x0, float y0, float dx0, float dy0,
+        float dx1, float dy1, float x1, float y1) {
+        add(8, {x0, y0, dx0, dy0, dx1, dy1, x1, y1});
+    }
+};
+
+template <typename H>
+void hash_xform(H &h, const xform::Xform &xf) {
+    for (int i = 0; i < 2; ++i) {
+        for (int j = 0; j < 3; ++j) h.add(xf[i][j]);
+    }
+}
+
+template <typename H>
+void hash_style(H &h, const stroke::Style &st) {
+    h.add(st.width());
+    h.add(st.join());
+    h.add(st.miter_limit());
+    h.add(st.cap());
+    h.add(st.dash_array().size());
+    for (float d: st.dash_array()) h.add(d);
+    h.add(st.phase_reset());
+    h.add(st.initial_phase());
+    h.add(st.method());
+}
+
+// Hashes the geometry of a shape in its own coordinates, leaving its
+// transformation out. Strokes hash their style and the shape they
+// stroke, transformation included.
+template <typename H>
+void hash_shape(H &h, const shape::Shape &shape) {
+    using shape::Shape;
+    h.add(shape.type());
+    switch (shape.type()) {
+        case Shape::Type::path: {
+            PathHasher<H> hasher(h);
+            shape.path().iterate(hasher);
+            break;
+        }
+        case Shape::Type::circle: {
+            const auto &c = shape.circle();
+            h.add(c.cx()); h.add(c.cy()); h.add(c.r());
+            break;
+        }
+        case Shape::Type::triangle: {
+            const auto &t = shape.triangle();
+            h.add(t.x1()); h.add(t.y1()); h.add(t.x2()); h.add(t.y2());
+            h.add(t.x3()); h.add(t.y3());
+            break;
+        }
+        case Shape::Type::rect: {
+            const auto &r = shape.rect();
+            h.add(r.x()); h.add(r.y()); h.add(r.width()); h.add(r.height());
+            break;
+        }
+        case Shape::Type::polygon: {
+            const auto &coordinates = shape.polygon().coordinates();
+            h.add(coordinates.size());
+            for (float c: coordinates) h.add(c);
+            break;
+        }
+        case Shape::Type::stroke: {
+            const auto &stroked = shape.stroke().shape();
+            hash_style(h, shape.stroke().style());
+            hash_xform(h, stroked.xf());
+            hash_shape(h, stroked);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+namespace detail {
+
+constexpr char cache_magic[8] = {'r', 'v', 'g', 'a', 'c', 'c', 'e', 'l'};
+constexpr uint32_t cache_endian = 0x01020304;
+constexpr int cache_sections = 11;
+constexpr uint64_t cache_align = 64;
+
+struct CacheSection {
+    uint64_t offset, count;
+    uint32_t record_size, pad;
+};
+
+struct CacheHeader {
+    char magic[8];
+    uint32_t version, endian;
+    uint64_t key;
+    CacheSection sections[cache_sections];
+};
+
+inline uint64_t cache_aligned(uint64_t offset) {
+    return (offset + cache_align-1) & ~(cache_align-1);
+}
+
+// Pointers to the start and number of records of each section
+struct CacheLayout {
+    const void *data[cache_sections];
+    uint64_t count[cache_sections];
+    uint32_t size[cache_sections];
+};
+
+template <typename T>
+inline void cache_section(CacheLayout &l, int i, const Array<T> &a) {
+    static_assert(std::is_trivially_copyable<T>::value,
+        "cached types must be trivially copyable");
+    l.data[i] = a.data();
+    l.count[i] = a.size();
+    l.size[i] = sizeof(T);
+}
+
+inline CacheLayout cache_layout(const Accelerated &accel) {
+    CacheLayout l;
+    cache_section(l, 0, accel.tree.cells());
+    cache_section(l, 1, accel.tree.elements());
+    cache_section(l, 2, accel.tree.segments());
+    cache_section(l, 3, accel.tree.shortcuts());
+    cache_section(l, 4, accel.elements);
+    cache_section(l, 5, accel.stops);
+    cache_section(l, 6, accel.textures);
+    cache_section(l, 7, accel.texels);
+    cache_section(l, 8, accel.ramps);
+    cache_section(l, 9, accel.fills);
+    cache_section(l, 10, accel.groups);
+    return l;
+}
+
+template <typename T>
+inline Array<T> cache_array(const char *base, const CacheHeader &h, int i) {
+    return Array<T>(reinterpret_cast<const T *>(base + h.sections[i].offset),
+        static_cast<size_t>(h.sections[i].count));
+}
+
+// Returns true if the first n records from first fit in size records
+inline bool cache_range(uint64_t first, uint64_t n, uint64_t size) {
+    return first <= size && n <= size - first;
+}
+
+// Returns true if every index stored in a cache file points inside the
+// array it refers to, so that a stale or corrupt file with a valid header
+// cannot send the renderer out of bounds
+inline bool cache_indices_valid(const Array<Cell> &cells,
+    const Array<CellElement> &cell_elements, uint64_t n_segments,
+    uint64_t n_shortcuts, const Array<Element> &elements, uint64_t n_stops,
+    const Array<Texture> &textures, uint64_t n_texels, uint64_t n_ramps,
+    uint64_t n_fills, const Array<Group> &groups) {
+    if (cells.empty() || (n_fills != 0 && n_fills != cells.size())) {
+        return false;
+    }
+    // children come after their parent, so descending always ends
+    for (size_t i = 0; i < cells.size(); ++i) {
+        const Cell &c = cells[i];
+        if (c.children >= 0) {
+            uint64_t k = static_cast<uint64_t>(c.children);
+            if (k <= i || !cache_range(k, 4, cells.size())) return false;
+            for (int j = 0; j < 4; ++j) {
+                if (cells[k+j].depth != c.depth+1) return false;
+            }
+        } else if (!cache_range(c.first_element, c.n_elements,
+            cell_elements.size())) {
+            return false;
+        }
+    }
+    for (const CellElement &ce: cell_elements) {
+        if (ce.element >= elements.size() ||
+            !cache_range(ce.first_segment, ce.n_segments, n_segments) ||
+            !cache_range(ce.first_shortcut, ce.n_shortcuts, n_shortcuts)) {
+            return false;
+        }
+    }
+    int64_t n_groups = static_cast<int64_t>(groups.size());
+    for (const Element &e: elements) {
+        if (!cache_range(e.first_stop, e.n_stops, n_stops) ||
+            !cache_range(e.first_ramp, e.n_ramp, n_ramps) ||
+            e.texture < -1 || e.texture >= static_cast<int64_t>(
+                textures.size()) ||
+            e.group < -1 || e.group >= n_groups ||
+            e.clip < -1 || e.clip >= n_groups) {
+            return false;
+        }
+    }
+    for (const Texture &t: textures) {
+        if (t.width <= 0 || t.height <= 0 ||
+            t.levels != mip_levels(t.width, t.height) ||
+            !cache_range(t.first_texel, mip_offset(t, t.levels), n_texels)) {
+            return false;
+        }
+    }
+    for (int64_t i = 0; i < n_groups; ++i) {
+        const Group &g = groups[static_cast<size_t>(i)];
+        if ((g.kind != Group::Kind::clip && g.kind != Group::Kind::fade) ||
+            g.parent < -1 || g.parent >= i || g.depth != (g.parent < 0? 1:
+            groups[static_cast<size_t>(g.parent)].depth+1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Maps (or, where there is no mmap, reads) a whole file into memory
+inline std::shared_ptr<const void> cache_map(const std::string &path,
+    uint64_t &size) {
+#ifndef _WIN32
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || st.st_size <= 0) {
+        ::close(fd);
+        return nullptr;
+    }
+    size = static_cast<uint64_t>(st.st_size);
+    void *p = ::mmap(nullptr, static_cast<size_t>(size), PROT_READ,
+        MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) return nullptr;
+    size_t length = static_cast<size_t>(size);
+    return std::shared_ptr<const void>(p, [length](const void *q) {
+        ::munmap(const_cast<void *>(q), length);
+    });
+#else
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f) return nullptr;
+    fseek(f, 0, SEEK_END);
+    long end = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (end <= 0) {
+        fclose(f);
+        return nullptr;
+    }
+    size = static_cast<uint64_t>(end);
+    // uint64_t storage is aligned enough for every cached type
+    std::shared_ptr<uint64_t> buffer(new uint64_t[(size+7)/8],
+        std::default_delete<uint64_t[]>());
+    bool ok = fread(buffer.get(), 1, static_cast<size_t>(size), f) == size;
+    fclose(f);
+    if (!ok) return nullptr;
+    return buffer;
+#endif
+}
+
+} // namespace detail
+
+// Loads the tree and elements stored in a cache file, if the file exists
+// and was written for the given key by this version of the driver. The
+// arrays in accel refer directly to the mapped file.
+inline bool load_cache(const std::string &path, uint64_t key,
+    Accelerated &accel) {
+    using namespace detail;
+    uint64_t size = 0;
+    std::shared_ptr<const void> storage = cache_map(path, size);
+    if (!storage || size < sizeof(CacheHeader)) return false;
+    const char *base = reinterpret_cast<const char *>(storage.get());
+    CacheHeader h;
+    std::memcpy(&h, base, sizeof(h));
+    if (std::memcmp(h.magic, cache_magic, sizeof(h.magic)) != 0 ||
+        h.version != cache_version || h.endian != cache_endian ||
+        h.key != key) {
+        return false;
+    }
+    // record sizes catch layout changes nobody remembered to version
+    CacheLayout expected = cache_layout(accel);
+    for (int i = 0; i < cache_sections; ++i) {
+        const CacheSection &s = h.sections[i];
+        if (s.record_size != expected.size[i] ||
+            s.offset % cache_align != 0 || s.offset > size ||
+            s.count > (size - s.offset)/s.record_size) {
+            return false;
+        }
+    }
+    Array<Cell> cells = cache_array<Cell>(base, h, 0);
+    Array<CellElement> cell_elements = cache_array<CellElement>(base, h, 1);
+    Array<Element> elements = cache_array<Element>(base, h, 4);
+    Array<Texture> textures = cache_array<Texture>(base, h, 6);
+    Array<Group> groups = cache_array<Group>(base, h, 10);
+    if (!cache_indices_valid(cells, cell_elements, h.sections[2].count,
+        h.sections[3].count, elements, h.sections[5].count, textures,
+        h.sections[7].count, h.sections[8].count, h.sections[9].count,
+        groups)) {
+        return false;
+    }
+    accel.tree.assign(std::move(cells), std::move(cell_elements),
+        cache_array<Segment>(base, h, 2),
+        cache_array<Shortcut>(base, h, 3));
+    accel.elements = std::move(elements);
+    accel.stops = cache_array<Stop>(base, h, 5);
+    accel.textures = std::move(textures);
+    accel.texels = cache_array<float>(base, h, 7);
+    accel.ramps = cache_array<RampColor>(base, h, 8);
+    accel.fills = cache_array<Fill>(base, h, 9);
+    accel.groups = std::move(groups);
+    accel.storage = std::move(storage);
+    return true;
+}
+
+// Writes accel into a cache file. The file is written under a temporary
+// name and renamed into place, so readers never see a partial file.
+inline bool store_cache(const std::string &path, uint64_t key,
+    const Accelerated &accel) {
+    using namespace detail;
+    CacheLayout l = cache_layout(accel);
+    CacheHeader h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, cache_magic, sizeof(h.magic));
+    h.version = cache_version;
+    h.endian = cache_endian;
+    h.key = key;
+    uint64_t offset = cache_aligned(sizeof(h));
+    for (int i = 0; i < cache_sections; ++i) {
+        h.sections[i].offset = offset;
+        h.sections[i].count = l.count[i];
+        h.sections[i].record_size = l.size[i];
+        offset = cache_aligned(offset + l.count[i]*l.size[i]);
+    }
+    std::string tmp = path + ".tmp";
+#ifndef _WIN32
+    tmp += std::to_string(static_cast<long>(::getpid()));
+#endif
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (!f) return false;
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+    uint64_t written = sizeof(h);
+    const char zeros[cache_align] = {0};
+    for (int i = 0; i < cache_sections && ok; ++i) {
+        uint64_t pad = h.sections[i].offset - written;
+        uint64_t bytes = l.count[i]*l.size[i];
+        ok = fwrite(zeros, 1, static_cast<size_t>(pad), f) == pad &&
+            (bytes == 0 || fwrite(l.data[i], 1, static_cast<size_t>(bytes),
+                f) == bytes);
+        written += pad + bytes;
+    }
+    ok = (fclose(f) == 0) && ok;
+    if (ok) ok = std::rename(tmp.c_str(), path.c_str()) == 0;
+    if (!ok) std::remove(tmp.c_str());
+    return ok;
+}
+
+} } } // namespace rvg::driver::png
+
+#endif
@@ -1,5 +1,3 @@
-#include <sstream>
-
 #include <lua.hpp>
 #include "description/lua.h"
 #include "compat/compat.h"
@@ -16,6 +14,7 @@
 #include "image/image.h"
 
 #include "driver/cpp/cpp.h"
+#include "driver/cpp/file-stream.h"
 
 using rvg::shape::Shape;
 using rvg::color::RGBA8;
@@ -431,9 +430,14 @@ static int luarender(lua_State *L) {
     auto a = rvg::description::lua::checkxformablescene(L, 1);
     auto v = rvg::description::lua::checkviewport(L, 2);
     FILE *f = compat_check_file(L, 3);
-    std::ostringstream sout;
-    rvg::driver::cpp::render(a, v, sout);
-    fwrite(sout.str().data(), 1, sout.str().size(), f);
+    bool failed = false;
+    {
+        rvg::driver::FileStream out(f);
+        rvg::driver::cpp::render(a, v, out);
+        out.flush();
+        failed = !out || fflush(f) != 0;
+    }
+    if (failed) return luaL_error(L, "unable to write cpp");
     return 0;
 }
 
@@ -0,0 +1,177 @@
+#ifndef RVG_DRIVER_PNG_DITHER_H
+#define RVG_DRIVER_PNG_DITHER_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "color/color.h"
+
+namespace rvg {
+    namespace driver {
+        namespace png {
+
+// How colors are quantized to 8 bits
+enum class Dither {
+    none,       // rounded to the nearest value
+    ordered,    // 8x8 Bayer matrix
+    blue        // 64x64 blue noise mask, by void and cluster
+};
+
+inline Dither dither_from_name(const std::string &name) {
+    if (name == "none") return Dither::none;
+    if (name == "ordered") return Dither::ordered;
+    if (name == "blue") return Dither::blue;
+    throw std::invalid_argument("unknown dither " + name);
+}
+
+// Thresholds in [0,1) tiled over the image
+class DitherMask {
+    int m_size;
+    std::vector<float> m_threshold;
+public:
+    // Each pixel gets a threshold from its rank in [0,size*size)
+    DitherMask(int size, const std::vector<int> &rank):
+        m_size(size),
+        m_threshold(rank.size()) {
+        float n = static_cast<float>(rank.size());
+        for (size_t p = 0; p < rank.size(); ++p) {
+            m_threshold[p] = (static_cast<float>(rank[p])+.5f)/n;
+        }
+    }
+
+    float at(int j, int i) const {
+        return m_threshold[(i & (m_size-1))*m_size + (j & (m_size-1))];
+    }
+};
+
+namespace detail {
+
+// Bayer matrix of size 2^bits: the bits of j^i and i, interleaved
+// and reversed
+inline std::vector<int> bayer_ranks(int bits) {
+    int size = 1 << bits;
+    std::vector<int> rank(size*size);
+    for (int i = 0; i < size; ++i) {
+        for (int j = 0; j < size; ++j) {
+            int x = j ^ i, r = 0;
+            for (int b = 0; b < bits; ++b) {
+                r = (r << 2) | (((x >> b) & 1) << 1) | ((i >> b) & 1);
+            }
+            rank[i*size+j] = r;
+        }
+    }
+    return rank;
+}
+
+// Ulichney's void and cluster method, on a torus of size x size pixels.
+// Points are ranked by the order in which they are removed from the
+// tightest clusters of an initial pattern, then added to its largest
+// voids. Seeded, so the mask is the same on every run.
+inline std::vector<int> void_and_cluster_ranks(int size) {
+    int n = size*size;
+    const float sigma = 1.5f;
+    std::vector<float> kernel(n);
+    for (int dy = 0; dy < size; ++dy) {
+        for (int dx = 0; dx < size; ++dx) {
+            float x = static_cast<float>(std::min(dx, size-dx));
+            float y = static_cast<float>(std::min(dy, size-dy));
+            kernel[dy*size+dx] = std::exp(-(x*x+y*y)/(2.f*sigma*sigma));
+        }
+    }
+    std::vector<char> bits(n, 0);
+    std::vector<float> energy(n, 0.f);
+    auto toggle = [&](int p) {
+        float s = bits[p]? -1.f: 1.f;
+        bits[p] = !bits[p];
+        int px = p % size, py = p / size;
+        for (int qy = 0; qy < size; ++qy) {
+            const float *row = &kernel[((qy-py+size) % size)*size];
+            for (int qx = 0; qx < size; ++qx) {
+                energy[qy*size+qx] += s*row[(qx-px+size) % size];
+            }
+        }
+    };
+    // point in the tightest cluster, or the largest void
+    auto extreme = [&](char bit) {
+        int best = -1;
+        for (int p = 0; p < n; ++p) {
+            if (bits[p] != bit) continue;
+            if (best < 0 || (bit? energy[p] > energy[best]:
+                energy[p] < energy[best])) {
+                best = p;
+            }
+        }
+        return best;
+    };
+    std::mt19937 rng(1);
+    int ones = n/10;
+    for (int count = 0; count < ones; ) {
+        int p = static_cast<int>(rng() % static_cast<unsigned>(n));
+        if (!bits[p]) {
+            toggle(p);
+            ++count;
+        }
+    }
+    // spread the initial points until the tightest cluster is also the
+    // largest void
+    for ( ;; ) {
+        int c = extreme(1);
+        toggle(c);
+        int v = extreme(0);
+        toggle(v);
+        if (v == c) break;
+    }
+    std::vector<int> rank(n);
+    std::vector<char> initial_bits = bits;
+    std::vector<float> initial_energy = energy;
+    for (int r = ones-1; r >= 0; --r) {
+        int c = extreme(1);
+        toggle(c);
+        rank[c] = r;
+    }
+    bits.swap(initial_bits);
+    energy.swap(initial_energy);
+    for (int r = ones; r < n; ++r) {
+        int v = extreme(0);
+        toggle(v);
+        rank[v] = r;
+    }
+    return rank;
+}
+
+} // namespace detail
+
+// Mask for the given method, built on first use, or null for none
+inline const DitherMask *dither_mask(Dither d) {
+    switch (d) {
+        case Dither::ordered: {
+            static const DitherMask bayer(8, detail::bayer_ranks(3));
+            return &bayer;
+        }
+        case Dither::blue: {
+            static const DitherMask blue(64,
+                detail::void_and_cluster_ranks(64));
+            return &blue;
+        }
+        default:
+            return nullptr;
+    }
+}
+
+// Quantizes v in [0,1] to 8 bits, adding the threshold of pixel j, i
+// in the mask before truncating
+inline uint8_t quantize(const DitherMask *mask, int j, int i, float v) {
+    if (!mask) return color::unorm_to_uint8_t(v);
+    float q = std::floor(std::min(std::max(v, 0.f), 1.f)*255.f +
+        mask->at(j, i));
+    return static_cast<uint8_t>(std::min(q, 255.f));
+}
+
+} } } // namespace rvg::driver::png
+
+#endif
@@ -0,0 +1,142 @@
+#ifndef RVG_DRIVER_FILE_STREAM_H
+#define RVG_DRIVER_FILE_STREAM_H
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <ios>
+#include <locale>
+#include <ostream>
+#include <streambuf>
+#include <vector>
+
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<charconv>)
+#include <charconv>
+#endif
+#endif
+
+namespace rvg {
+    namespace driver {
+
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+// Writes v to buf with the fewest significant digits that read back as
+// v, and returns the number of characters written. Doubles that hold a
+// float value, as the floats streams promote do, get the fewest digits
+// that read back as that float when parsed as a float. Parsed as a
+// double, those digits need not give v back: 0.1f comes out as 0.1.
+inline int format_shortest(double v, char *buf, size_t size) {
+    float f = static_cast<float>(v);
+    auto r = static_cast<double>(f) == v? std::to_chars(buf, buf+size, f):
+        std::to_chars(buf, buf+size, v);
+    return r.ec == std::errc()? static_cast<int>(r.ptr - buf): 0;
+}
+
+// Formats floating-point numbers with format_shortest. Streams set to
+// another notation, precision or width are formatted as usual.
+class ShortestNumPut: public std::num_put<char> {
+protected:
+    iter_type do_put(iter_type out, std::ios_base &str, char fill,
+        double v) const override {
+        const std::ios_base::fmtflags custom = std::ios_base::floatfield |
+            std::ios_base::showpos | std::ios_base::showpoint |
+            std::ios_base::uppercase;
+        if ((str.flags() & custom) || str.precision() != 6 ||
+            str.width() != 0 || !std::isfinite(v)) {
+            return std::num_put<char>::do_put(out, str, fill, v);
+        }
+        char buf[32];
+        int n = format_shortest(v, buf, sizeof(buf));
+        for (int i = 0; i < n; ++i) *out++ = buf[i];
+        return out;
+    }
+};
+#endif
+
+// Locale of the classic one with numbers formatted by ShortestNumPut.
+// Without std::to_chars, it is the classic locale itself: finding the
+// shortest digits with snprintf and strtod costs more than the digits
+// it saves.
+inline std::locale shortest_locale(void) {
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+    return std::locale(std::locale::classic(), new ShortestNumPut);
+#else
+    return std::locale::classic();
+#endif
+}
+
+// Stream buffer writing to a FILE through a buffer of its own, so that
+// documents go out as they are formatted instead of piling up in memory.
+// Writes larger than the buffer skip it.
+class FileBuf final: public std::streambuf {
+    FILE *m_file;
+    std::vector<char> m_buffer;
+
+    bool drain(void) {
+        size_t n = static_cast<size_t>(pptr() - pbase());
+        setp(m_buffer.data(), m_buffer.data() + m_buffer.size());
+        return n == 0 || fwrite(m_buffer.data(), 1, n, m_file) == n;
+    }
+
+protected:
+    int_type overflow(int_type c) override {
+        if (!drain()) return traits_type::eof();
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    std::streamsize xsputn(const char *s, std::streamsize n) override {
+        if (n > epptr() - pptr()) {
+            if (!drain()) return 0;
+            if (n >= static_cast<std::streamsize>(m_buffer.size())) {
+                return static_cast<std::streamsize>(fwrite(s, 1,
+                    static_cast<size_t>(n), m_file));
+            }
+        }
+        std::memcpy(pptr(), s, static_cast<size_t>(n));
+        pbump(static_cast<int>(n));
+        return n;
+    }
+
+    int sync(void) override {
+        return drain()? 0: -1;
+    }
+
+public:
+    explicit FileBuf(FILE *file, size_t size = 1 << 16):
+        m_file(file),
+        m_buffer(size) {
+        setp(m_buffer.data(), m_buffer.data() + m_buffer.size());
+    }
+
+    FileBuf(const FileBuf &) = delete;
+    FileBuf &operator=(const FileBuf &) = delete;
+
+    ~FileBuf() {
+        drain();
+    }
+};
+
+// Output stream over a FILE, with numbers in shortest form. What is
+// written reaches the FILE once the stream is flushed or destroyed.
+class FileStream final: public std::ostream {
+    FileBuf m_buf;
+public:
+    explicit FileStream(FILE *file):
+        std::ostream(nullptr),
+        m_buf(file) {
+        rdbuf(&m_buf);
+        imbue(shortest_locale());
+    }
+
+    ~FileStream() {
+        flush();
+    }
+};
+
+} } // namespace rvg::driver
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef RVG_DRIVER_PNG_HEATMAP_H
+#define RVG_DRIVER_PNG_HEATMAP_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+namespace rvg {
+    namespace driver {
+        namespace png {
+
+// What the value of each pixel of a heatmap measures
+enum class HeatMetric {
+    none,       // render the image itself
+    segments,   // segment tests, over all samples of the pixel
+    shortcuts,  // shortcut tests
+    depth,      // depth of the leaf containing the pixel center
+    time        // nanoseconds spent sampling the pixel
+};
+
+inline HeatMetric heat_metric_from_name(const std::string &name) {
+    if (name == "segments") return HeatMetric::segments;
+    if (name == "shortcuts") return HeatMetric::shortcuts;
+    if (name == "depth") return HeatMetric::depth;
+    if (name == "time") return HeatMetric::time;
+    throw std::invalid_argument("unknown heatmap metric " + name);
+}
+
+// What the values of a metric count, for reports
+inline const char *heat_metric_unit(HeatMetric m) {
+    switch (m) {
+        case HeatMetric::segments: return "segment tests";
+        case HeatMetric::shortcuts: return "shortcut tests";
+        case HeatMetric::depth: return "levels";
+        case HeatMetric::time: return "ns";
+        default: return "";
+    }
+}
+
+// Maps v in [0,max] to a color, on a log scale from black through
+// purple, red and orange to pale yellow
+inline void heat_color(float v, float max, uint8_t rgb[3]) {
+    static const float stops[5][3] = {
+        {0.f, 0.f, 4.f}, {87.f, 16.f, 110.f}, {188.f, 55.f, 84.f},
+        {249.f, 142.f, 9.f}, {252.f, 255.f, 164.f}
+    };
+    float t = max > 0.f? std::log1p(std::max(v, 0.f))/std::log1p(max): 0.f;
+    t = std::min(std::max(t, 0.f), 1.f)*4.f;
+    int k = std::min(static_cast<int>(t), 3);
+    float f = t - static_cast<float>(k);
+    for (int c = 0; c < 3; ++c) {
+        float x = stops[k][c] + f*(stops[k+1][c] - stops[k][c]);
+        rgb[c] = static_cast<uint8_t>(std::lround(x));
+    }
+}
+
+} } } // namespace rvg::driver::png
+
+#endif
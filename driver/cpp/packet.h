@@ -0,0 +1,152 @@
+#ifndef RVG_DRIVER_PNG_PACKET_H
+#define RVG_DRIVER_PNG_PACKET_H
+
+#include <cstdint>
+
+#include "driver/cpp/shortcut-tree.h"
+
+#if defined(__GNUC__)
+#define RVG_DRIVER_PNG_VECTOR 1
+#if defined(__x86_64__) || defined(__i386__)
+#define RVG_DRIVER_PNG_X86 1
+#endif
+#endif
+
+namespace rvg {
+    namespace driver {
+        namespace png {
+
+// Number of samples tested together against each segment
+constexpr int packet_size = 8;
+
+// A packet of samples, all inside the same leaf of the shortcut tree.
+// Unused lanes must hold copies of a used one.
+struct Packet {
+    alignas(32) float x[packet_size];
+    alignas(32) float y[packet_size];
+};
+
+// Computes the winding number of cell element ce at each sample in the
+// packet. All kernels return exactly the same results as
+// ShortcutTree::winding applied to each sample in turn.
+using PacketWinding = void (*)(const ShortcutTree &tree,
+    const CellElement &ce, const Packet &p, int32_t *w);
+
+namespace detail {
+
+inline void packet_winding_scalar(const ShortcutTree &tree,
+    const CellElement &ce, const Packet &p, int32_t *w) {
+    for (int k = 0; k < packet_size; ++k) {
+        w[k] = tree.winding(ce, p.x[k], p.y[k]);
+    }
+}
+
+#ifdef RVG_DRIVER_PNG_VECTOR
+
+// Vectors of 4 and 8 lanes, for SSE and AVX2 registers
+typedef float vfloat4 __attribute__((vector_size(16)));
+typedef int32_t vint4 __attribute__((vector_size(16)));
+typedef float vfloat8 __attribute__((vector_size(32)));
+typedef int32_t vint8 __attribute__((vector_size(32)));
+
+// Vectors are passed by reference throughout, so that the 8-lane code
+// compiled without AVX2 never has to agree on a calling convention
+template <typename VI>
+inline bool any(const VI &m) {
+    for (int k = 0; k < static_cast<int>(sizeof(VI)/sizeof(int32_t)); ++k) {
+        if (m[k]) return true;
+    }
+    return false;
+}
+
+// Lane-wise version of Segment::crosses. The same operations are
+// performed in the same order, so results match the scalar test.
+template <typename VF, typename VI>
+inline void crosses(const Segment &s, const VF &px, const VF &py, VI &c) {
+    VI in = (py >= s.ymin) & (py < s.ymax) & (px < s.xmax);
+    c = in;
+    if (!any(in)) return;
+    VI left = in & (px < s.xmin);
+    VI rest = in & ~left;
+    c = left;
+    if (!any(rest)) return;
+    VF dx = px - s.x[0], dy = py - s.y[0];
+    VI chord = static_cast<float>(s.dir)*(s.cx*dy - s.cy*dx) > 0.f;
+    VI side = chord;
+    if (s.type != Segment::Type::linear) {
+        VI out = (s.tri[0]*dx + s.tri[1]*dy < 0.f) |
+            (s.tri[2]*dx + s.tri[3]*dy + s.tri[4] < 0.f);
+        VF value;
+        s.implicit(dx, dy, value);
+        VI imp = s.sign*value > 0.f;
+        // on the bulge side of the chord, outside the triangle means
+        // the bulge side of the curve, inside it the implicit decides
+        VI bulge = s.bulge_left? (out | imp): ~(out | imp);
+        VI on_bulge = s.bulge_left? chord: ~chord;
+        side = (on_bulge & bulge) | (~on_bulge & chord);
+    }
+    c = left | (rest & side);
+}
+
+// Runs the lane-wise test over the packet, one vector at a time
+template <typename VF, typename VI>
+inline void packet_winding_vector(const ShortcutTree &tree,
+    const CellElement &ce, const Packet &p, int32_t *w) {
+    const int lanes = static_cast<int>(sizeof(VF)/sizeof(float));
+    const Shortcut *sc = &tree.shortcuts()[ce.first_shortcut];
+    const Segment *s = &tree.segments()[ce.first_segment];
+    for (int first = 0; first < packet_size; first += lanes) {
+        VF px, py;
+        for (int k = 0; k < lanes; ++k) {
+            px[k] = p.x[first+k];
+            py[k] = p.y[first+k];
+        }
+        VI wv = VI{} + ce.winding;
+        for (uint32_t i = 0; i < ce.n_shortcuts; ++i) {
+            wv += ((sc[i].ylo <= py) & (py < sc[i].yhi)) & sc[i].dir;
+        }
+        for (uint32_t i = 0; i < ce.n_segments; ++i) {
+            VI c;
+            crosses(s[i], px, py, c);
+            wv += c & static_cast<int32_t>(s[i].dir);
+        }
+        for (int k = 0; k < lanes; ++k) {
+            w[first+k] = wv[k];
+        }
+    }
+}
+
+inline void packet_winding_vector4(const ShortcutTree &tree,
+    const CellElement &ce, const Packet &p, int32_t *w) {
+    packet_winding_vector<vfloat4, vint4>(tree, ce, p, w);
+}
+
+#ifdef RVG_DRIVER_PNG_X86
+// Same kernel, with everything inlined and compiled for AVX2
+__attribute__((target("avx2"), flatten))
+inline void packet_winding_avx2(const ShortcutTree &tree,
+    const CellElement &ce, const Packet &p, int32_t *w) {
+    packet_winding_vector<vfloat8, vint8>(tree, ce, p, w);
+}
+#endif
+
+#endif // RVG_DRIVER_PNG_VECTOR
+
+} // namespace detail
+
+// Returns the fastest kernel supported by the processor we are running on
+inline PacketWinding select_packet_winding(void) {
+#ifdef RVG_DRIVER_PNG_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return detail::packet_winding_avx2;
+#endif
+#ifdef RVG_DRIVER_PNG_VECTOR
+    return detail::packet_winding_vector4;
+#else
+    return detail::packet_winding_scalar;
+#endif
+}
+
+} } } // namespace rvg::driver::png
+
+#endif
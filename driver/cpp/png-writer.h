@@ -0,0 +1,204 @@
+#ifndef RVG_DRIVER_PNG_PNG_WRITER_H
+#define RVG_DRIVER_PNG_PNG_WRITER_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <csetjmp>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <png.h>
+
+#include "driver/cpp/band.h"
+
+namespace rvg {
+    namespace driver {
+        namespace png {
+
+// Writes an 8-bit RGBA PNG one row at a time, top row first, so that
+// no image has to be held in memory. libpng reports errors by jumping
+// back to the setjmp in each method, which then throws.
+class PngWriter {
+    png_structp m_png;
+    png_infop m_info;
+    int m_width;
+
+    static void fail(png_structp png, png_const_charp message) {
+        (void) message;
+        longjmp(png_jmpbuf(png), 1);
+    }
+
+    static void warn(png_structp, png_const_charp) { ; }
+
+public:
+    PngWriter(FILE *out, int width, int height):
+        m_png(nullptr),
+        m_info(nullptr),
+        m_width(width) {
+        m_png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr,
+            fail, warn);
+        if (m_png) m_info = png_create_info_struct(m_png);
+        if (!m_info) {
+            png_destroy_write_struct(&m_png, nullptr);
+            throw std::runtime_error("out of memory creating png");
+        }
+        if (setjmp(png_jmpbuf(m_png))) {
+            png_destroy_write_struct(&m_png, &m_info);
+            throw std::runtime_error("error writing png header");
+        }
+        png_init_io(m_png, out);
+        png_set_IHDR(m_png, m_info, width, height, 8,
+            PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE,
+            PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+        png_write_info(m_png, m_info);
+    }
+
+    PngWriter(const PngWriter &) = delete;
+    PngWriter &operator=(const PngWriter &) = delete;
+
+    ~PngWriter() {
+        png_destroy_write_struct(&m_png, &m_info);
+    }
+
+    int width(void) const { return m_width; }
+
+    // Row of width RGBA pixels
+    void write_row(const uint8_t *rgba) {
+        if (setjmp(png_jmpbuf(m_png))) {
+            throw std::runtime_error("error writing png row");
+        }
+        png_write_row(m_png, const_cast<png_bytep>(rgba));
+    }
+
+    void finish(void) {
+        if (setjmp(png_jmpbuf(m_png))) {
+            throw std::runtime_error("error finishing png");
+        }
+        png_write_end(m_png, m_info);
+    }
+};
+
+// Second stage of the rendering pipeline. Bands are submitted from the
+// top of the image down, and a thread of its own converts and compresses
+// them while the next ones are rendered. At most window bands exist at
+// any time, so memory depends on the band size, not on the image size.
+class BandEncoder {
+    PngWriter m_png;
+    int m_height;
+    Precision m_precision;
+    const DitherMask *m_dither;
+    size_t m_window, m_allocated;
+    std::mutex m_mutex;
+    std::condition_variable m_changed;
+    std::deque<Band> m_full;
+    std::vector<Band> m_free;
+    bool m_closing;
+    std::exception_ptr m_error;
+    std::thread m_thread;
+
+    void encode(const Band &band, std::vector<uint8_t> &row) {
+        for (int i = band.first()+band.rows()-1; i >= band.first(); --i) {
+            band.get_row(i, row.data());
+            m_png.write_row(row.data());
+        }
+    }
+
+    void run(void) {
+        std::vector<uint8_t> row(4*static_cast<size_t>(m_png.width()));
+        for ( ;; ) {
+            Band band;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_changed.wait(lock, [this]() {
+                    return !m_full.empty() || m_closing;
+                });
+                if (m_full.empty()) break;
+                band = std::move(m_full.front());
+                m_full.pop_front();
+            }
+            try {
+                if (!m_error) encode(band, row);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_error = std::current_exception();
+            }
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_free.push_back(std::move(band));
+            m_changed.notify_all();
+        }
+    }
+
+public:
+    BandEncoder(FILE *out, int width, int height, int window,
+        Precision precision, const DitherMask *dither):
+        m_png(out, width, height),
+        m_height(height),
+        m_precision(precision),
+        m_dither(dither),
+        m_window(static_cast<size_t>(std::max(window, 1))),
+        m_allocated(0),
+        m_closing(false),
+        m_thread(&BandEncoder::run, this)
+        { ; }
+
+    BandEncoder(const BandEncoder &) = delete;
+    BandEncoder &operator=(const BandEncoder &) = delete;
+
+    ~BandEncoder() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_closing = true;
+            m_changed.notify_all();
+        }
+        if (m_thread.joinable()) m_thread.join();
+    }
+
+    // Returns storage for rows [first, first+rows), waiting for the
+    // encoder to release a band if the window is full
+    Band acquire(int width, int first, int rows) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_changed.wait(lock, [this]() {
+            return !m_free.empty() || m_allocated < m_window;
+        });
+        Band band(m_precision, m_dither);
+        if (!m_free.empty()) {
+            band = std::move(m_free.back());
+            m_free.pop_back();
+        } else {
+            ++m_allocated;
+        }
+        band.reset(width, first, rows);
+        return band;
+    }
+
+    void submit(Band &&band) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_full.push_back(std::move(band));
+        m_changed.notify_all();
+    }
+
+    // Waits for every band to be written and closes the image
+    void finish(void) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_closing = true;
+            m_changed.notify_all();
+        }
+        m_thread.join();
+        if (m_error) std::rethrow_exception(m_error);
+        m_png.finish();
+    }
+
+    int height(void) const { return m_height; }
+};
+
+} } } // namespace rvg::driver::png
+
+#endif
@@ -1,5 +1,15 @@
 #include <memory>
 #include <tuple>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <climits>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
 
 #include <lua.hpp>
 
@@ -7,45 +17,2086 @@
 #include "compat/compat.h"
 
 #include "image/image.h"
-#include "image/pngio.h"
 #include "chronos/chronos.h"
+#include "path/path.h"
+#include "path/filter/xformer.h"
+#include "color/color.h"
+#include "xform/xform.h"
 
 #include "driver/cpp/png.h"
+#include "driver/cpp/thread-pool.h"
+#include "driver/cpp/packet.h"
+#include "driver/cpp/cache.h"
+#include "driver/cpp/supersampling.h"
+#include "driver/cpp/texture.h"
+#include "driver/cpp/png-writer.h"
+#include "driver/cpp/blur.h"
+#include "driver/cpp/stroke-cache.h"
+#include "driver/cpp/stats.h"
+#include "driver/cpp/heatmap.h"
 
 namespace rvg {
     namespace driver {
         namespace png {
 
-// This is one of the functions you must implement. It
-// receives a scene and a viewport. It returns an
-// acceleration datastructure that contains all scene
-// information in a form that enables fast sampling.
-// For now, it simply returns the scene itself.
-Accelerated accelerate(const XformableScene &xs, const Viewport &vp) {
+using xform::Xform;
+using paint::Paint;
+using paint::Spread;
+using scene::WindingRule;
+
+static bool inside(WindingRule wr, int w) {
+    switch (wr) {
+        case WindingRule::non_zero: return w != 0;
+        case WindingRule::zero: return w == 0;
+        case WindingRule::odd: return (w & 1) != 0;
+        case WindingRule::even: return (w & 1) == 0;
+        default: return false;
+    }
+}
+
+// Alpha from which compositing stops, since nothing beneath can show
+constexpr float opaque_alpha = 1.f - 1.f/1024.f;
+
+// Options accepted in the args vector. Both accelerate and render
+// receive the same vector, so each parses all options.
+struct Options {
+    int threads = default_thread_count();
+    int tile = 32;
+    std::string cache;
+    std::vector<float> tx = std::vector<float>(1, 0.f);
+    std::vector<float> ty = std::vector<float>(1, 0.f);
+    std::string frames;
+    TreeParams tree;
+    int pattern = 0;
+    Filter filter = Filter::gaussian;
+    float radius = .5f;
+    float adaptive = -1.f;      // contrast threshold, negative if disabled
+    int ramp = 256;             // entries in gradient ramp tables
+    int band = 256;             // rows rendered before they are encoded
+    Precision precision = Precision::f32;
+    Dither dither = Dither::none;
+    bool outofcore = false;     // build a tree for each band when rendering
+    int stroke_cache = 256;     // megabytes of stroke outlines kept around
+    std::string stats;          // file render writes statistics to
+    int hot_cells = 32;         // busiest leaves in the statistics, or 0
+    std::string times;          // file render writes frame times to
+    HeatMetric heatmap = HeatMetric::none;
+    std::string heatmap_file;   // where the heatmap goes, if not to out
+};
+
+// If arg is the option -name, sets value and returns true
+static bool flag_option(const std::string &arg, const char *name,
+    bool &value) {
+    if (arg != name) return false;
+    value = true;
+    return true;
+}
+
+// If arg is the option -name:<int>, stores the value and returns true.
+// Throws if the value is malformed.
+static bool int_option(const std::string &arg, const char *name, int &value) {
+    std::string prefix = std::string(name) + ':';
+    if (arg.compare(0, prefix.size(), prefix) != 0) return false;
+    const char *str = arg.c_str() + prefix.size();
+    char *end = nullptr;
+    long v = std::strtol(str, &end, 10);
+    if (end == str || *end != '\0' || v < INT_MIN || v > INT_MAX) {
+        throw std::invalid_argument("invalid option " + arg);
+    }
+    value = static_cast<int>(v);
+    return true;
+}
+
+// If arg is the option -name:<string>, stores the value and returns true
+static bool string_option(const std::string &arg, const char *name,
+    std::string &value) {
+    std::string prefix = std::string(name) + ':';
+    if (arg.compare(0, prefix.size(), prefix) != 0) return false;
+    value = arg.substr(prefix.size());
+    return true;
+}
+
+// Parses a number, throwing if there is anything else in str
+static float parse_float(const std::string &str, const std::string &arg) {
+    const char *begin = str.c_str();
+    char *end = nullptr;
+    float value = std::strtof(begin, &end);
+    if (end == begin || *end != '\0' || !std::isfinite(value)) {
+        throw std::invalid_argument("invalid option " + arg);
+    }
+    return value;
+}
+
+// If arg is the option -name:<number>, stores the number and returns true
+static bool float_option(const std::string &arg, const char *name,
+    float &value) {
+    std::string str;
+    if (!string_option(arg, name, str)) return false;
+    value = parse_float(str, arg);
+    return true;
+}
+
+// If arg is the option -name:<list>, stores the values and returns true.
+// The list is separated by commas, and each item is either a number or
+// an inclusive range first:last[:step], with step 1 by default.
+static bool float_list_option(const std::string &arg, const char *name,
+    std::vector<float> &values) {
+    std::string list;
+    if (!string_option(arg, name, list)) return false;
+    values.clear();
+    size_t begin = 0;
+    for ( ;; ) {
+        size_t comma = std::min(list.find(',', begin), list.size());
+        std::string item = list.substr(begin, comma-begin);
+        std::vector<float> f;
+        size_t start = 0;
+        for ( ;; ) {
+            size_t colon = std::min(item.find(':', start), item.size());
+            f.push_back(parse_float(item.substr(start, colon-start), arg));
+            if (colon == item.size()) break;
+            start = colon+1;
+        }
+        if (f.size() == 1) {
+            values.push_back(f[0]);
+        } else if (f.size() <= 3) {
+            float first = f[0], last = f[1];
+            float step = f.size() > 2? f[2]: (last >= first? 1.f: -1.f);
+            if (step == 0.f || (last-first)/step < 0.f ||
+                (last-first)/step > 1e6f) {
+                throw std::invalid_argument("invalid option " + arg);
+            }
+            int n = static_cast<int>(std::floor((last-first)/step + 1e-4f));
+            for (int i = 0; i <= n; ++i) values.push_back(first + i*step);
+        } else {
+            throw std::invalid_argument("invalid option " + arg);
+        }
+        if (comma == list.size()) break;
+        begin = comma+1;
+    }
+    return true;
+}
+
+static Options parse_args(const std::vector<std::string> &args) {
+    Options parsed;
+    std::vector<float> weights;
+    std::string filter, dither, heatmap;
+    int precision = 32;
+    for (const auto &arg: args) {
+        if (int_option(arg, "-threads", parsed.threads)) {
+            // number of threads building the tree and rendering
+            if (parsed.threads < 1) {
+                throw std::invalid_argument("invalid option " + arg);
+            }
+        } else if (int_option(arg, "-tile", parsed.tile)) {
+            // width and height of the tiles threads work on
+            if (parsed.tile < 1) {
+                throw std::invalid_argument("invalid option " + arg);
+            }
+        } else if (float_list_option(arg, "-tx", parsed.tx)) {
+            // translations of the scene along x, in pixels, one per frame
+            ;
+        } else if (float_list_option(arg, "-ty", parsed.ty)) {
+            // translations along y
+            ;
+        } else if (string_option(arg, "-frames", parsed.frames)) {
+            // output file names, with %x and %y replaced by translations
+            if (parsed.frames.empty()) {
+                throw std::invalid_argument("invalid option " + arg);
+            }
+        } else if (int_option(arg, "-maxdepth", parsed.tree.max_depth)) {
+            // depth beyond which cells are never split
+            if (parsed.tree.max_depth < 0) {
+                throw std::invalid_argument("invalid option " + arg);
+            }
+        } else if (int_option(arg, "-maxseg", parsed.tree.max_segments)) {
+            // cells with this many segments or fewer are never split
+            if (parsed.tree.max_segments < 0) {
+                throw std::invalid_argument("invalid option " + arg);
+            }
+        } else if (float_option(arg, "-maxcost", parsed.tree.max_cost)) {
+            // cells are split while their sampling cost exceeds this
+            if (parsed.tree.max_cost < 0.f) {
+                throw std::invalid_argument("invalid option " + arg);
+            }
+        } else if (float_list_option(arg, "-cost", weights)) {
+            // weights of linear, quadratic, rational and cubic segments
+            if (weights.size() != 4) {
+                throw std::invalid_argument("invalid option " + arg);
+            }
+            for (int i = 0; i < 4; ++i) {
+                if (weights[i] < 0.f) {
+                    throw std::invalid_argument("invalid option " + arg);
+                }
+                parsed.tree.weights[i] = weights[i];
+            }
+        } else if (int_option(arg, "-pattern", parsed.pattern)) {
+            // supersampling pattern, blue[N] in the blue module
+            if (parsed.pattern < 1) {
+                throw std::invalid_argument("invalid option " + arg);
+            }
+        } else if (string_option(arg, "-filter", filter)) {
+            // reconstruction filter: box, tent, gaussian or mitchell
+            parsed.filter = filter_from_name(filter);
+        } else if (float_option(arg, "-radius", parsed.radius)) {
+            // half width of the area pattern samples are spread over
+            if (!(parsed.radius > 0.f)) {
+                throw std::invalid_argument("invalid option " + arg);
+            }
+        } else if (float_option(arg, "-adaptive", parsed.adaptive)) {
+            // supersample only near edges, and refine where the contrast
+            // between the first samples exceeds this threshold
+            if (parsed.adaptive < 0.f) {
+                throw std::invalid_argument("invalid option " + arg);
+            }
+        } else if (int_option(arg, "-ramp", parsed.ramp)) {
+            // resolution of the tables gradient ramps are turned into
+            if (parsed.ramp < 2 || parsed.ramp > 65536) {
+                throw std::invalid_argument("invalid option " + arg);
+            }
+        } else if (int_option(arg, "-band", parsed.band)) {
+            // rows in each band handed to the png encoder
+            if (parsed.band < 1) {
+                throw std::invalid_argument("invalid option " + arg);
+            }
+        } else if (string_option(arg, "-stats", parsed.stats)) {
+            // JSON file with what render spent its time on
+            if (parsed.stats.empty()) {
+                throw std::invalid_argument("invalid option " + arg);
+            }
+        } else if (int_option(arg, "-hotcells", parsed.hot_cells)) {
+            // leaves -stats lists by the tests taken in them, 0 for all
+            if (parsed.hot_cells < 0) {
+                throw std::invalid_argument("invalid option " + arg);
+            }
+        } else if (string_option(arg, "-heatmap", heatmap)) {
+            // image of the work each pixel took instead of its color,
+            // or alongside it with -heatmap:<metric>:<file>
+            size_t colon = heatmap.find(':');
+            parsed.heatmap = heat_metric_from_name(heatmap.substr(0, colon));
+            if (colon != std::string::npos) {
+                parsed.heatmap_file = heatmap.substr(colon+1);
+                if (parsed.heatmap_file.empty()) {
+                    throw std::invalid_argument("invalid option " + arg);
+                }
+            }
+        } else if (string_option(arg, "-times", parsed.times)) {
+            // seconds each frame spent culling, rendering and saving,
+            // without the counting -stats does
+            if (parsed.times.empty()) {
+                throw std::invalid_argument("invalid option " + arg);
+            }
+        } else if (int_option(arg, "-strokecache", parsed.stroke_cache)) {
+            // megabytes of stroke outlines reused across accelerate calls
+            if (parsed.stroke_cache < 0) {
+                throw std::invalid_argument("invalid option " + arg);
+            }
+        } else if (int_option(arg, "-precision", precision)) {
+            // bits per channel of the framebuffer: 32, 16 (half) or 8
+            switch (precision) {
+                case 32: parsed.precision = Precision::f32; break;
+                case 16: parsed.precision = Precision::f16; break;
+                case 8: parsed.precision = Precision::u8; break;
+                default:
+                    throw std::invalid_argument("invalid option " + arg);
+            }
+        } else if (string_option(arg, "-dither", dither)) {
+            // quantization to 8 bits: none, ordered or blue
+            parsed.dither = dither_from_name(dither);
+        } else if (flag_option(arg, "-outofcore", parsed.outofcore)) {
+            // keep the scene flattened, and cull it to each band
+            ;
+        } else if (string_option(arg, "-cache", parsed.cache)) {
+            // directory holding acceleration cache files
+            if (parsed.cache.empty()) {
+                throw std::invalid_argument("invalid option " + arg);
+            }
+        } else {
+            throw std::invalid_argument("unrecognized option " + arg);
+        }
+    }
+    return parsed;
+}
+
+// Receives path instructions already in screen space and breaks them
+// into monotonic segments. Contours are closed with a linear segment.
+class SegmentCollector final: public path::IPath<SegmentCollector> {
+    std::vector<Segment> &m_segments;
+    float m_x0, m_y0;
+public:
+    explicit SegmentCollector(std::vector<Segment> &segments):
+        m_segments(segments),
+        m_x0(0.f),
+        m_y0(0.f)
+        { ; }
+
+private:
+    friend path::IPath<SegmentCollector>;
+
+    void emit(const Segment &s) {
+        m_segments.push_back(s);
+    }
+
+    void do_begin_closed_contour(uint16_t len, float x0, float y0) {
+        (void) len;
+        m_x0 = x0; m_y0 = y0;
+    }
+
+    void do_begin_open_contour(uint16_t len, float x0, float y0) {
+        (void) len;
+        m_x0 = x0; m_y0 = y0;
+    }
+
+    void do_end_open_contour(float x0, float y0, uint16_t len) {
+        (void) len;
+        // open contours are filled as if they were closed
+        do_linear_segment(x0, y0, m_x0, m_y0);
+    }
+
+    void do_end_closed_contour(float x0, float y0, uint16_t len) {
+        (void) len;
+        do_linear_segment(x0, y0, m_x0, m_y0);
+    }
+
+    void do_linear_segment(float x0, float y0, float x1, float y1) {
+        emit_linear_segment(x0, y0, x1, y1,
+            [this](const Segment &s) { emit(s); });
+    }
+
+    void do_quadratic_segment(float x0, float y0, float x1, float y1,
+        float x2, float y2) {
+        emit_quadratic_segment(x0, y0, x1, y1, x2, y2,
+            [this](const Segment &s) { emit(s); });
+    }
+
+    void do_rational_quadratic_segment(float x0, float y0, float x1, float y1,
+        float w1, float x2, float y2) {
+        emit_rational_quadratic_segment(x0, y0, x1, y1, w1, x2, y2,
+            [this](const Segment &s) { emit(s); });
+    }
+
+    void do_cubic_segment(float x0, float y0, float x1, float y1,
+        float x2, float y2, float x3, float y3) {
+        emit_cubic_segment(x0, y0, x1, y1, x2, y2, x3, y3,
+            [this](const Segment &s) { emit(s); });
+    }
+
+    void do_degenerate_segment(float x0, float y0, float dx0, float dy0,
+        float dx1, float dy1, float x1, float y1) {
+        (void) dx0; (void) dy0; (void) dx1; (void) dy1;
+        do_linear_segment(x0, y0, x1, y1);
+    }
+};
+
+// Interpolates the premultiplied color of a ramp at t in [0,1]
+static void ramp_color(const Stop *stops, uint32_t n, float t,
+    float &r, float &g, float &b, float &a) {
+    if (n == 0) {
+        r = g = b = a = 0.f;
+        return;
+    }
+    if (t <= stops[0].offset) {
+        const Stop &s = stops[0];
+        r = s.r; g = s.g; b = s.b; a = s.a;
+        return;
+    }
+    for (uint32_t i = 1; i < n; ++i) {
+        const Stop &s1 = stops[i];
+        if (t <= s1.offset) {
+            const Stop &s0 = stops[i-1];
+            float d = s1.offset - s0.offset;
+            float u = d > 0.f? (t - s0.offset)/d: 1.f;
+            r = s0.r + u*(s1.r - s0.r);
+            g = s0.g + u*(s1.g - s0.g);
+            b = s0.b + u*(s1.b - s0.b);
+            a = s0.a + u*(s1.a - s0.a);
+            return;
+        }
+    }
+    const Stop &s = stops[n-1];
+    r = s.r; g = s.g; b = s.b; a = s.a;
+}
+
+// Scene flattened into segments and paints, ready for tree construction.
+// Segments of element e are segments[offsets[e]] to segments[offsets[e+1]-1].
+struct Flattened {
+    std::vector<Segment> segments;
+    std::vector<uint32_t> offsets;
+    std::vector<Element> elements;
+    std::vector<Stop> stops;
+    std::vector<RampColor> ramps;
+    std::vector<Texture> textures;
+    std::vector<float> texels;
+    std::vector<Group> groups;
+};
+
+static void render_layer(const Flattened &flat, size_t first, size_t last,
+    int32_t root, const int box[4], float scale, int threads,
+    std::vector<float> &image);
+
+// Outlines of the strokes flattened so far, shared by every accelerate
+// call, so that animations and repeated instances outline each stroke
+// only once
+static StrokeCache &stroke_cache(void) {
+    static StrokeCache cache(0);
+    return cache;
+}
+
+// Walks the scene, accumulating transformations, and produces the
+// segments of each painted element along with its paint. Stencils are
+// elements too, and clips and fades become groups around the elements
+// inside them. The contents of each blur are rendered into a layer as
+// soon as the blur ends, blurred, and replaced by a rectangle painted
+// with the layer as a texture.
+class SceneFlattener final: public scene::IScene<SceneFlattener> {
+    // Blur whose contents are still being flattened
+    struct Blur {
+        size_t first_element;
+        int32_t group;          // around the blur
+        float sigma;            // in pixels
+    };
+
+    Flattened &m_flat;
+    uint32_t m_ramp_size;
+    float m_bounds[4];
+    int m_threads;
+    Xform m_xf;
+    std::vector<Xform> m_xf_stack;
+    std::vector<int32_t> m_groups;      // clips and fades around us
+    std::vector<int32_t> m_defining;    // clips whose stencils come next
+    std::vector<Blur> m_blurs;
+    std::unordered_map<const image::IImage *, int32_t> m_textures;
+public:
+    // Blurs are only rendered where they can reach into bounds
+    SceneFlattener(const Xform &screen_xf, uint32_t ramp_size,
+        const float bounds[4], int threads, Flattened &flat):
+        m_flat(flat),
+        m_ramp_size(ramp_size),
+        m_bounds{bounds[0], bounds[1], bounds[2], bounds[3]},
+        m_threads(threads),
+        m_xf(screen_xf) {
+        m_flat.offsets.assign(1, 0);
+    }
+
+private:
+    friend scene::IScene<SceneFlattener>;
+
+    void set_stops(const paint::Ramp &ramp, Element &e) {
+        e.spread = ramp.spread();
+        e.first_stop = static_cast<uint32_t>(m_flat.stops.size());
+        e.n_stops = static_cast<uint32_t>(ramp.stops().size());
+        for (const auto &stop: ramp.stops()) {
+            const auto &c = stop.color();
+            float a = color::uint8_t_to_unorm(c.a());
+            m_flat.stops.push_back(Stop{stop.offset(),
+                a*color::uint8_t_to_unorm(c.r()),
+                a*color::uint8_t_to_unorm(c.g()),
+                a*color::uint8_t_to_unorm(c.b()), a});
+        }
+        // tabulate the ramp, so samples never search the stops
+        e.first_ramp = static_cast<uint32_t>(m_flat.ramps.size());
+        e.n_ramp = m_ramp_size;
+        const Stop *stops = m_flat.stops.data() + e.first_stop;
+        for (uint32_t i = 0; i < m_ramp_size; ++i) {
+            float t = static_cast<float>(i)/static_cast<float>(m_ramp_size-1);
+            RampColor c;
+            ramp_color(stops, e.n_stops, t, c.r, c.g, c.b, c.a);
+            m_flat.ramps.push_back(c);
+        }
+    }
+
+    // Converts each distinct image to premultiplied RGBA, once
+    int32_t add_texture(const image::IImage &img) {
+        auto found = m_textures.find(&img);
+        if (found != m_textures.end()) return found->second;
+        int32_t index = static_cast<int32_t>(m_flat.textures.size());
+        m_textures.emplace(&img, index);
+        Texture t{img.width(), img.height(),
+            mip_levels(img.width(), img.height()),
+            static_cast<uint64_t>(m_flat.texels.size())};
+        m_flat.textures.push_back(t);
+        int n = img.channels();
+        for (int j = 0; j < t.height; ++j) {
+            for (int i = 0; i < t.width; ++i) {
+                float r, g, b, a;
+                if (n >= 3) {
+                    r = img.get_unorm(i, j, 0);
+                    g = img.get_unorm(i, j, 1);
+                    b = img.get_unorm(i, j, 2);
+                    a = n > 3? img.get_unorm(i, j, 3): 1.f;
+                } else {
+                    r = g = b = img.get_unorm(i, j, 0);
+                    a = n > 1? img.get_unorm(i, j, 1): 1.f;
+                }
+                float texel[4] = {r*a, g*a, b*a, a};
+                m_flat.texels.insert(m_flat.texels.end(), texel, texel+4);
+            }
+        }
+        build_mipmaps(t, m_flat.texels);
+        return index;
+    }
+
+    void set_paint(const Paint &paint, Element &e) {
+        e.type = paint.type();
+        e.opacity = color::uint8_t_to_unorm(paint.opacity());
+        Xform ixf = paint.xf().transformed(m_xf).inverse();
+        for (int i = 0; i < 2; ++i) {
+            for (int j = 0; j < 3; ++j) {
+                e.ixf[3*i+j] = ixf[i][j];
+            }
+        }
+        switch (paint.type()) {
+            case Paint::Type::solid_color: {
+                const auto &c = paint.solid_color();
+                e.a = e.opacity*color::uint8_t_to_unorm(c.a());
+                e.r = e.a*color::uint8_t_to_unorm(c.r());
+                e.g = e.a*color::uint8_t_to_unorm(c.g());
+                e.b = e.a*color::uint8_t_to_unorm(c.b());
+                break;
+            }
+            case Paint::Type::linear_gradient: {
+                const auto &lg = paint.linear_gradient();
+                e.x1 = lg.x1(); e.y1 = lg.y1();
+                e.x2 = lg.x2(); e.y2 = lg.y2();
+                set_stops(lg.ramp(), e);
+                break;
+            }
+            case Paint::Type::radial_gradient: {
+                const auto &rg = paint.radial_gradient();
+                e.cx = rg.cx(); e.cy = rg.cy(); e.rr = rg.r();
+                // keep the focus strictly inside the circle
+                float dx = rg.fx()-e.cx, dy = rg.fy()-e.cy;
+                float d = std::sqrt(dx*dx + dy*dy), dmax = .999f*e.rr;
+                if (d > dmax) { dx *= dmax/d; dy *= dmax/d; }
+                e.fx = e.cx+dx; e.fy = e.cy+dy;
+                set_stops(rg.ramp(), e);
+                break;
+            }
+            case Paint::Type::texture:
+                e.spread = paint.texture().spread();
+                e.texture = add_texture(paint.texture().image());
+                e.lod = texture_lod(m_flat.textures[e.texture], e.ixf);
+                break;
+            default:
+                e.a = 0.f;
+                break;
+        }
+    }
+
+    void collect(const Shape &shape, const Xform &xf) {
+        Shape path_shape = shape.as_path_shape(xf);
+        SegmentCollector collector(m_flat.segments);
+        path_shape.path().iterate(path::filter::make_xformer(xf, collector));
+    }
+
+    int32_t current_group(void) const {
+        return m_groups.empty()? -1: m_groups.back();
+    }
+
+    int32_t add_group(Group::Kind kind, float opacity) {
+        int32_t parent = current_group();
+        int32_t depth = parent < 0? 1: m_flat.groups[parent].depth+1;
+        m_flat.groups.push_back(Group{kind, parent, depth, opacity});
+        return static_cast<int32_t>(m_flat.groups.size()-1);
+    }
+
+    void add_element(const Element &e, const Shape &shape) {
+        Xform xf = shape.xf().transformed(m_xf);
+        if (shape.type() == Shape::Type::stroke) {
+            // outlining, dashes included, costs far more than a lookup
+            // and only depends on the translation by moving the outline
+            StrokeKey key = stroke_key(shape, xf);
+            float tx = xf[0][2], ty = xf[1][2];
+            if (!stroke_cache().find(key, tx, ty, m_flat.segments)) {
+                size_t first = m_flat.segments.size();
+                collect(shape, xf);
+                stroke_cache().insert(key, tx, ty,
+                    m_flat.segments.begin() + first, m_flat.segments.end());
+            }
+        } else {
+            collect(shape, xf);
+        }
+        m_flat.offsets.push_back(
+            static_cast<uint32_t>(m_flat.segments.size()));
+        m_flat.elements.push_back(e);
+    }
+
+    void do_painted_element(WindingRule wr, const Shape &shape,
+        const Paint &paint) {
+        Element e{};
+        e.winding_rule = wr;
+        e.texture = -1;
+        e.group = current_group();
+        e.clip = -1;
+        set_paint(paint, e);
+        add_element(e, shape);
+    }
+
+    void do_stencil_element(WindingRule wr, const Shape &shape) {
+        if (m_defining.empty()) return;
+        Element e{};
+        e.winding_rule = wr;
+        e.type = Paint::Type::solid_color;
+        e.texture = -1;
+        e.group = current_group();
+        e.clip = m_defining.back();
+        add_element(e, shape);
+    }
+
+    void do_begin_clip(uint16_t depth) {
+        (void) depth;
+        m_defining.push_back(add_group(Group::Kind::clip, 1.f));
+    }
+
+    void do_activate_clip(uint16_t depth) {
+        (void) depth;
+        m_groups.push_back(m_defining.back());
+        m_defining.pop_back();
+    }
+
+    void do_end_clip(uint16_t depth) {
+        (void) depth;
+        m_groups.pop_back();
+    }
+
+    void do_begin_fade(uint16_t depth, uint8_t opacity) {
+        (void) depth;
+        m_groups.push_back(add_group(Group::Kind::fade,
+            color::uint8_t_to_unorm(opacity)));
+    }
+
+    void do_end_fade(uint16_t depth, uint8_t opacity) {
+        (void) depth; (void) opacity;
+        m_groups.pop_back();
+    }
+
+    void do_begin_blur(uint16_t depth, float radius) {
+        (void) depth;
+        // radius is a standard deviation in the current coordinates
+        float scale = std::sqrt(std::fabs(m_xf[0][0]*m_xf[1][1] -
+            m_xf[0][1]*m_xf[1][0]));
+        m_blurs.push_back(Blur{m_flat.elements.size(), current_group(),
+            radius*scale});
+    }
+
+    void do_end_blur(uint16_t depth, float radius) {
+        (void) depth; (void) radius;
+        Blur blur = m_blurs.back();
+        m_blurs.pop_back();
+        if (blur.sigma < .25f) return;
+        size_t first = blur.first_element, last = m_flat.elements.size();
+        uint32_t first_segment = m_flat.offsets[first];
+        // pixels the blurred contents reach, within reach of the bounds
+        float reach = 3.f*blur.sigma;
+        float xmin = m_bounds[2], ymin = m_bounds[3];
+        float xmax = m_bounds[0], ymax = m_bounds[1];
+        for (uint32_t i = first_segment; i < m_flat.segments.size(); ++i) {
+            const Segment &s = m_flat.segments[i];
+            xmin = std::min(xmin, s.xmin); ymin = std::min(ymin, s.ymin);
+            xmax = std::max(xmax, s.xmax); ymax = std::max(ymax, s.ymax);
+        }
+        int box[4] = {
+            static_cast<int>(std::floor(std::max(xmin, m_bounds[0])-reach)),
+            static_cast<int>(std::floor(std::max(ymin, m_bounds[1])-reach)),
+            static_cast<int>(std::ceil(std::min(xmax, m_bounds[2])+reach)),
+            static_cast<int>(std::ceil(std::min(ymax, m_bounds[3])+reach))
+        };
+        std::vector<float> image;
+        // very large layers are rendered at a lower resolution
+        const int max_layer = 4096;
+        int w = box[2]-box[0], h = box[3]-box[1];
+        float scale = std::min(1.f, static_cast<float>(max_layer)/
+            static_cast<float>(std::max(std::max(w, h), 1)));
+        if (w > 0 && h > 0 && first_segment < m_flat.segments.size()) {
+            render_layer(m_flat, first, last, blur.group, box, scale,
+                m_threads, image);
+        }
+        // the layer replaces the contents of the blur
+        m_flat.elements.resize(first);
+        m_flat.offsets.resize(first+1);
+        m_flat.segments.resize(first_segment);
+        if (image.empty()) return;
+        int32_t lw = std::max(1, static_cast<int32_t>(std::ceil(w*scale)));
+        int32_t lh = std::max(1, static_cast<int32_t>(std::ceil(h*scale)));
+        gaussian_blur(image, lw, lh, blur.sigma*scale);
+        Texture t{lw, lh, mip_levels(lw, lh),
+            static_cast<uint64_t>(m_flat.texels.size())};
+        m_flat.texels.insert(m_flat.texels.end(), image.begin(),
+            image.end());
+        build_mipmaps(t, m_flat.texels);
+        Element e{};
+        e.winding_rule = WindingRule::non_zero;
+        e.type = Paint::Type::texture;
+        e.spread = Spread::pad;
+        e.opacity = 1.f;
+        e.texture = static_cast<int32_t>(m_flat.textures.size());
+        m_flat.textures.push_back(t);
+        // screen to texture coordinates in [0,1]
+        float x0 = static_cast<float>(box[0]), y0 = static_cast<float>(box[1]);
+        float x1 = x0 + lw/scale, y1 = y0 + lh/scale;
+        const float ixf[6] = {scale/lw, 0.f, -x0*scale/lw,
+            0.f, scale/lh, -y0*scale/lh};
+        std::copy(ixf, ixf+6, e.ixf);
+        e.lod = texture_lod(t, e.ixf);
+        e.group = blur.group;
+        e.clip = -1;
+        auto emit = [this](const Segment &s) {
+            m_flat.segments.push_back(s);
+        };
+        emit_linear_segment(x0, y0, x1, y0, emit);
+        emit_linear_segment(x1, y0, x1, y1, emit);
+        emit_linear_segment(x1, y1, x0, y1, emit);
+        emit_linear_segment(x0, y1, x0, y0, emit);
+        m_flat.offsets.push_back(
+            static_cast<uint32_t>(m_flat.segments.size()));
+        m_flat.elements.push_back(e);
+    }
+
+    void do_begin_transform(uint16_t depth, const Xform &xf) {
+        (void) depth;
+        m_xf_stack.push_back(m_xf);
+        m_xf = xf.transformed(m_xf);
+    }
+
+    void do_end_transform(uint16_t depth, const Xform &xf) {
+        (void) depth; (void) xf;
+        m_xf = m_xf_stack.back();
+        m_xf_stack.pop_back();
+    }
+};
+
+// Hashes every event of a scene, with everything SceneFlattener reads
+// from it, so that a cached accel can be found before flattening
+class SceneHasher final: public scene::IScene<SceneHasher> {
+    Hasher &m_h;
+    // images are hashed once, and then referred to by index
+    std::unordered_map<const image::IImage *, uint32_t> m_images;
+public:
+    explicit SceneHasher(Hasher &h): m_h(h) { ; }
+
+private:
+    friend scene::IScene<SceneHasher>;
+
+    // events are told apart by a tag, so that their contents never run
+    // into each other
+    enum class Event: uint8_t {
+        painted, stencil, begin_clip, activate_clip, end_clip,
+        begin_fade, end_fade, begin_blur, end_blur,
+        begin_transform, end_transform
+    };
+
+    void add_ramp(const paint::Ramp &ramp) {
+        m_h.add(ramp.spread());
+        m_h.add(ramp.stops().size());
+        for (const auto &stop: ramp.stops()) {
+            const auto &c = stop.color();
+            m_h.add(stop.offset());
+            m_h.add(c.r()); m_h.add(c.g()); m_h.add(c.b()); m_h.add(c.a());
+        }
+    }
+
+    void add_image(const image::IImage &img) {
+        auto found = m_images.find(&img);
+        if (found != m_images.end()) {
+            m_h.add(found->second);
+            return;
+        }
+        uint32_t index = static_cast<uint32_t>(m_images.size());
+        m_images.emplace(&img, index);
+        m_h.add(index);
+        int n = img.channels();
+        m_h.add(img.width()); m_h.add(img.height()); m_h.add(n);
+        for (int j = 0; j < img.height(); ++j) {
+            for (int i = 0; i < img.width(); ++i) {
+                for (int c = 0; c < n; ++c) m_h.add(img.get_unorm(i, j, c));
+            }
+        }
+    }
+
+    void add_paint(const Paint &paint) {
+        m_h.add(paint.type());
+        m_h.add(paint.opacity());
+        hash_xform(m_h, paint.xf());
+        switch (paint.type()) {
+            case Paint::Type::solid_color: {
+                const auto &c = paint.solid_color();
+                m_h.add(c.r()); m_h.add(c.g()); m_h.add(c.b()); m_h.add(c.a());
+                break;
+            }
+            case Paint::Type::linear_gradient: {
+                const auto &lg = paint.linear_gradient();
+                m_h.add(lg.x1()); m_h.add(lg.y1());
+                m_h.add(lg.x2()); m_h.add(lg.y2());
+                add_ramp(lg.ramp());
+                break;
+            }
+            case Paint::Type::radial_gradient: {
+                const auto &rg = paint.radial_gradient();
+                m_h.add(rg.cx()); m_h.add(rg.cy());
+                m_h.add(rg.fx()); m_h.add(rg.fy()); m_h.add(rg.r());
+                add_ramp(rg.ramp());
+                break;
+            }
+            case Paint::Type::texture:
+                m_h.add(paint.texture().spread());
+                add_image(paint.texture().image());
+                break;
+            default:
+                break;
+        }
+    }
+
+    void add_shape(const Shape &shape) {
+        hash_xform(m_h, shape.xf());
+        hash_shape(m_h, shape);
+    }
+
+    void do_painted_element(WindingRule wr, const Shape &shape,
+        const Paint &paint) {
+        m_h.add(Event::painted);
+        m_h.add(wr);
+        add_shape(shape);
+        add_paint(paint);
+    }
+
+    void do_stencil_element(WindingRule wr, const Shape &shape) {
+        m_h.add(Event::stencil);
+        m_h.add(wr);
+        add_shape(shape);
+    }
+
+    void do_begin_clip(uint16_t depth) {
+        m_h.add(Event::begin_clip); m_h.add(depth);
+    }
+
+    void do_activate_clip(uint16_t depth) {
+        m_h.add(Event::activate_clip); m_h.add(depth);
+    }
+
+    void do_end_clip(uint16_t depth) {
+        m_h.add(Event::end_clip); m_h.add(depth);
+    }
+
+    void do_begin_fade(uint16_t depth, uint8_t opacity) {
+        m_h.add(Event::begin_fade); m_h.add(depth); m_h.add(opacity);
+    }
+
+    void do_end_fade(uint16_t depth, uint8_t opacity) {
+        m_h.add(Event::end_fade); m_h.add(depth); m_h.add(opacity);
+    }
+
+    void do_begin_blur(uint16_t depth, float radius) {
+        m_h.add(Event::begin_blur); m_h.add(depth); m_h.add(radius);
+    }
+
+    void do_end_blur(uint16_t depth, float radius) {
+        m_h.add(Event::end_blur); m_h.add(depth); m_h.add(radius);
+    }
+
+    void do_begin_transform(uint16_t depth, const Xform &xf) {
+        m_h.add(Event::begin_transform); m_h.add(depth);
+        hash_xform(m_h, xf);
+    }
+
+    void do_end_transform(uint16_t depth, const Xform &xf) {
+        m_h.add(Event::end_transform); m_h.add(depth);
+        hash_xform(m_h, xf);
+    }
+};
+
+// Hashes everything the accel is built from: the scene, its
+// transformation, the bounds of the tree and the options that shape it
+static uint64_t cache_key(const XformableScene &xs, const float bounds[4],
+    const Options &options, const TreeParams &params) {
+    Hasher h;
+    h.add(cache_version);
+    for (int i = 0; i < 4; ++i) h.add(bounds[i]);
+    h.add(params.max_depth);
+    h.add(params.max_segments);
+    h.add(params.max_cost);
+    h.add(params.samples_per_pixel);
+    for (float w: params.weights) h.add(w);
+    h.add(options.ramp);
+    hash_xform(h, xs.xf());
+    SceneHasher hasher(h);
+    xs.scene().iterate(hasher);
+    return h.value();
+}
+
+// Returns true if the paint of e is opaque wherever e covers a sample,
+// so that it hides every element beneath it. Elements in groups may be
+// clipped or faded, and stencils paint nothing.
+static bool is_opaque(const Element &e, const RampColor *ramps,
+    const Texture *textures, const float *texels) {
+    if (e.group >= 0 || e.clip >= 0) return false;
+    switch (e.type) {
+        case Paint::Type::solid_color:
+            return e.a >= opaque_alpha;
+        case Paint::Type::linear_gradient:
+        case Paint::Type::radial_gradient:
+            if (e.spread == Spread::transparent || e.n_ramp == 0) {
+                return false;
+            }
+            for (uint32_t i = 0; i < e.n_ramp; ++i) {
+                if (e.opacity*ramps[e.first_ramp+i].a < opaque_alpha) {
+                    return false;
+                }
+            }
+            return true;
+        case Paint::Type::texture: {
+            if (e.spread == Spread::transparent || e.texture < 0) {
+                return false;
+            }
+            // coarser levels average finer ones, so level 0 decides
+            const Texture &tex = textures[e.texture];
+            const float *t = texels + tex.first_texel;
+            uint64_t n = static_cast<uint64_t>(tex.width)*
+                static_cast<uint64_t>(tex.height);
+            for (uint64_t i = 0; i < n; ++i) {
+                if (e.opacity*t[4*i+3] < opaque_alpha) return false;
+            }
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+// Resolves the color of every leaf whose samples all get the same one,
+// compositing front to back over the background just like sample does
+static void fill_cells(Accelerated &accel) {
+    const ShortcutTree &tree = accel.tree;
+    std::vector<Fill> fills(tree.cells().size(), Fill{0.f, 0.f, 0.f, -1.f});
+    for (size_t c = 0; c < tree.cells().size(); ++c) {
+        const Cell &cell = tree.cells()[c];
+        if (cell.children >= 0) continue;
+        const CellElement *ce = &tree.elements()[cell.first_element];
+        float r = 0.f, g = 0.f, b = 0.f, a = 0.f;
+        bool constant = true;
+        for (uint32_t i = cell.n_elements; i-- > 0; ) {
+            const Element &e = accel.elements[ce[i].element];
+            if (ce[i].n_segments != 0 || ce[i].n_shortcuts != 0 ||
+                e.group >= 0 || e.clip >= 0 ||
+                (inside(e.winding_rule, ce[i].winding) &&
+                 e.type != Paint::Type::solid_color)) {
+                constant = false;
+                break;
+            }
+            if (!inside(e.winding_rule, ce[i].winding)) continue;
+            float t = 1.f - a;
+            r += t*e.r; g += t*e.g; b += t*e.b; a += t*e.a;
+            if (a >= opaque_alpha) {
+                a = 1.f;
+                break;
+            }
+        }
+        if (constant) {
+            // composite over white background
+            float t = 1.f - a;
+            fills[c] = Fill{r + t, g + t, b + t, 1.f};
+        }
+    }
+    accel.fills = Array<Fill>(std::move(fills));
+}
+
+// Box the tree covers. Translated frames sample the scene at x-tx, y-ty,
+// and the samples of a pattern reach up to radius past the pixel center,
+// so those of border pixels fall past the viewport.
+static void tree_bounds(const Viewport &vp, const Options &options,
+    float bounds[4]) {
+    int xl, yb, xr, yt;
+    std::tie(xl, yb) = vp.bl();
+    std::tie(xr, yt) = vp.tr();
+    auto tx = std::minmax_element(options.tx.begin(), options.tx.end());
+    auto ty = std::minmax_element(options.ty.begin(), options.ty.end());
+    float reach = options.pattern > 0? options.radius: 0.f;
+    bounds[0] = static_cast<float>(std::min(xl, xr)) - *tx.second - reach;
+    bounds[1] = static_cast<float>(std::min(yb, yt)) - *ty.second - reach;
+    bounds[2] = static_cast<float>(std::max(xl, xr)) - *tx.first + reach;
+    bounds[3] = static_cast<float>(std::max(yb, yt)) - *ty.first + reach;
+}
+
+static TreeParams tree_params(const Options &options) {
+    TreeParams params = options.tree;
+    params.threads = options.threads;
+    // blue[N] holds N samples
+    params.samples_per_pixel = static_cast<float>(std::max(1,
+        options.pattern));
+    return params;
+}
+
+// Flattens the scene into monotonic segments and builds a shortcut
+// tree over the viewport. With -cache:<dir>, the result is looked up in,
+// and otherwise saved to, a file named after a hash of the inputs.
+Accelerated accelerate(const XformableScene &xs, const Viewport &vp,
+    const std::vector<std::string> &args) {
+    Options options = parse_args(args);
 Chronos time;
-    (void) vp;
+    float bounds[4];
+    tree_bounds(vp, options, bounds);
+    TreeParams params = tree_params(options);
+    Accelerated accel;
+    std::string cache_path;
+    uint64_t key = 0;
+    // out-of-core accels hold no tree, so there is nothing to cache
+    if (!options.cache.empty() && !options.outofcore) {
+        key = cache_key(xs, bounds, options, params);
+        char name[32];
+        snprintf(name, sizeof(name), "/%016llx.accel",
+            static_cast<unsigned long long>(key));
+        cache_path = options.cache + name;
+        if (load_cache(cache_path, key, accel)) {
+fprintf(stderr, "loaded %s in %.3fs\n", cache_path.c_str(), time.elapsed());
+            return accel;
+        }
+    }
+    uint64_t hits, misses;
+    stroke_cache().set_budget(static_cast<size_t>(options.stroke_cache) << 20);
+    stroke_cache().counts(hits, misses);
+    Flattened flat;
+    SceneFlattener flattener(xs.xf(), static_cast<uint32_t>(options.ramp),
+        bounds, options.threads, flat);
+    xs.scene().iterate(flattener);
+    uint64_t new_hits, new_misses;
+    stroke_cache().counts(new_hits, new_misses);
+    if (new_hits + new_misses > hits + misses) {
+fprintf(stderr, "outlined %llu strokes, reused %llu\n",
+    static_cast<unsigned long long>(new_misses - misses),
+    static_cast<unsigned long long>(new_hits - hits));
+    }
+    // each sample of a pattern covers only part of the pixel
+    for (Element &e: flat.elements) {
+        if (e.type == Paint::Type::texture) {
+            e.lod -= .5f*std::log2(params.samples_per_pixel);
+        }
+    }
+    const auto &elements = flat.elements;
+    std::vector<char> opaque(elements.size());
+    for (size_t e = 0; e < elements.size(); ++e) {
+        opaque[e] = is_opaque(elements[e], flat.ramps.data(),
+            flat.textures.data(), flat.texels.data());
+    }
+    if (options.outofcore) {
+        // render builds a tree for each band out of these
+        accel.segments = Array<Segment>(std::move(flat.segments));
+        accel.offsets = Array<uint32_t>(std::move(flat.offsets));
+    } else {
+        accel.tree.build(flat.segments, flat.offsets,
+            bounds[0], bounds[1], bounds[2], bounds[3], params,
+            [&elements](uint32_t e, int w) {
+                return inside(elements[e].winding_rule, w);
+            },
+            [&opaque](uint32_t e) { return opaque[e] != 0; });
+    }
+    accel.elements = Array<Element>(std::move(flat.elements));
+    accel.stops = Array<Stop>(std::move(flat.stops));
+    accel.ramps = Array<RampColor>(std::move(flat.ramps));
+    accel.textures = Array<Texture>(std::move(flat.textures));
+    accel.texels = Array<float>(std::move(flat.texels));
+    accel.groups = Array<Group>(std::move(flat.groups));
+    if (!options.outofcore) fill_cells(accel);
 fprintf(stderr, "preprocessing in %.3fs\n", time.elapsed());
-    return xs;
+    if (!cache_path.empty() && !store_cache(cache_path, key, accel)) {
+fprintf(stderr, "unable to write %s\n", cache_path.c_str());
+    }
+    return accel;
 }
 
 using Pixel = std::tuple<float, float, float, float>;
 
-// This is the other function you have to implement.
-// It receives the acceleration datastructure and a sampling
-// position. It returns the color at that position.
-static Pixel sample(const Accelerated &accel, float x, float y) {
-    (void) accel; (void) x; (void) y;
-    // Implement your own;
-    return Pixel(0.f,0.f,0.f,1.f);
+// Maps a ramp parameter according to the spread. Returns false if the
+// paint is transparent at that parameter.
+static bool spread(Spread s, float &t) {
+    switch (s) {
+        case Spread::pad:
+            t = std::min(1.f, std::max(0.f, t));
+            return true;
+        case Spread::repeat:
+            t -= std::floor(t);
+            return true;
+        case Spread::reflect:
+            t = std::fabs(t - 2.f*std::floor(.5f*t + .5f));
+            return true;
+        case Spread::transparent:
+            return t >= 0.f && t <= 1.f;
+        default:
+            return false;
+    }
 }
 
-// In theory, you don't have to change this function.
-// It simply allocates the image, samples each pixel center,
-// and saves the image into the file.
-void render(const Accelerated &accel, const Viewport &vp, FILE *out,
-    const std::vector<std::string> &args) {
-    (void) args;
+// Looks up a ramp table at parameter t, folded by the spread into [0,1],
+// interpolating linearly between the two nearest entries. Returns false
+// if the paint is transparent at t.
+static bool ramp_lookup(const RampColor *ramp, uint32_t n, Spread s, float t,
+    float &r, float &g, float &b, float &a) {
+    // -ramp makes tables at least 2 entries long
+    if (n < 2 || !spread(s, t)) return false;
+    float f = std::min(std::max(t, 0.f), 1.f)*static_cast<float>(n-1);
+    uint32_t i = std::min(static_cast<uint32_t>(f), n-2);
+    float w = f - static_cast<float>(i);
+    const RampColor &c0 = ramp[i], &c1 = ramp[i+1];
+    r = c0.r + w*(c1.r - c0.r);
+    g = c0.g + w*(c1.g - c0.g);
+    b = c0.b + w*(c1.b - c0.b);
+    a = c0.a + w*(c1.a - c0.a);
+    return true;
+}
+
+// Evaluates the premultiplied color of an element at a sample
+static void paint_color(const Accelerated &accel, const Element &e,
+    float x, float y, float &r, float &g, float &b, float &a) {
+    if (e.type == Paint::Type::solid_color) {
+        r = e.r; g = e.g; b = e.b; a = e.a;
+        return;
+    }
+    r = g = b = a = 0.f;
+    float px = e.ixf[0]*x + e.ixf[1]*y + e.ixf[2];
+    float py = e.ixf[3]*x + e.ixf[4]*y + e.ixf[5];
+    switch (e.type) {
+        case Paint::Type::linear_gradient: {
+            float dx = e.x2 - e.x1, dy = e.y2 - e.y1;
+            float d = dx*dx + dy*dy;
+            float t = d > 0.f? ((px - e.x1)*dx + (py - e.y1)*dy)/d: 0.f;
+            if (!ramp_lookup(accel.ramps.data() + e.first_ramp, e.n_ramp,
+                e.spread, t, r, g, b, a)) {
+                return;
+            }
+            break;
+        }
+        case Paint::Type::radial_gradient: {
+            // t such that the sample is on the circle centered at
+            // f + t*(c-f) with radius t*r
+            float dx = px - e.fx, dy = py - e.fy;
+            float ex = e.cx - e.fx, ey = e.cy - e.fy;
+            float A = ex*ex + ey*ey - e.rr*e.rr;
+            float B = dx*ex + dy*ey;
+            float C = dx*dx + dy*dy;
+            float den = B + std::sqrt(std::max(0.f, B*B - A*C));
+            float t = den > 0.f? C/den: 0.f;
+            if (!ramp_lookup(accel.ramps.data() + e.first_ramp, e.n_ramp,
+                e.spread, t, r, g, b, a)) {
+                return;
+            }
+            break;
+        }
+        case Paint::Type::texture: {
+            if (e.texture < 0) return;
+            if (!spread(e.spread, px) || !spread(e.spread, py)) return;
+            sample_texture(accel.textures[e.texture], accel.texels.data(),
+                px, py, e.lod, r, g, b, a);
+            break;
+        }
+        default:
+            return;
+    }
+    r *= e.opacity; g *= e.opacity; b *= e.opacity; a *= e.opacity;
+}
+
+// Where sampling counts its work: into the counters of the calling
+// thread, or of the pixel a heatmap is measuring, and into the -stats
+// report of the render call. Either may be null. Each render call passes
+// its own down to the sampling functions, so calls running at the same
+// time never count into each other.
+struct Tally {
+    Counters *counters;
+    RenderStats *stats;
+
+    // Adds samples taken in a leaf, and their tests, to the -stats report
+    void count_cell(const Cell &cell, uint64_t samples,
+        uint64_t tests) const {
+        if (stats) stats->count_cell(cell, samples, tests);
+    }
+};
+
+// Tally of the calling thread for a render call with stats, if not null
+static Tally thread_tally(RenderStats *stats) {
+    return Tally{stats? &stats->local(): nullptr, stats};
+}
+
+static int paint_kind(Paint::Type type) {
+    switch (type) {
+        case Paint::Type::linear_gradient:
+            return static_cast<int>(PaintKind::linear);
+        case Paint::Type::radial_gradient:
+            return static_cast<int>(PaintKind::radial);
+        case Paint::Type::texture:
+            return static_cast<int>(PaintKind::texture);
+        default:
+            return static_cast<int>(PaintKind::solid);
+    }
+}
+
+// Per thread record of the clips that cover the current sample. A clip
+// covers it if its stamp equals the stamp of the sample, so nothing has
+// to be cleared between samples.
+struct ClipStamps {
+    std::vector<uint32_t> stamps;
+    uint32_t current = 0;
+
+    void next(size_t n) {
+        if (stamps.size() < n) stamps.resize(n, 0);
+        if (++current == 0) {
+            std::fill(stamps.begin(), stamps.end(), 0);
+            current = 1;
+        }
+    }
+};
+
+// Intermediate result of a group, while its elements are composited
+struct Layer {
+    float r, g, b, a;
+    int32_t group;
+    bool hidden;    // clipped away, or behind something opaque
+};
+
+static int32_t group_depth(const Accelerated &accel, int32_t g) {
+    return g < 0? 0: accel.groups[g].depth;
+}
+
+// Returns true if group g is outer or nested in it
+static bool contains(const Accelerated &accel, int32_t outer, int32_t g) {
+    int32_t depth = group_depth(accel, outer);
+    while (group_depth(accel, g) > depth) g = accel.groups[g].parent;
+    return g == outer;
+}
+
+// Returns true if every clip from group g up to, but excluding, root
+// covers the sample
+static bool unclipped(const Accelerated &accel, const ClipStamps &clips,
+    int32_t g, int32_t root) {
+    for ( ; g != root && g >= 0; g = accel.groups[g].parent) {
+        if (accel.groups[g].kind == Group::Kind::clip &&
+            clips.stamps[g] != clips.current) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Composites the elements in the cell that cover the sample, front to
+// back, into group root (-1 for the whole scene), and adds the result
+// to r, g, b, a. Stops as soon as the color is opaque.
+static void composite(const Accelerated &accel, const Tally &tally,
+    const Cell &cell, float x, float y, int32_t root, float &r, float &g,
+    float &b, float &a) {
+    const ShortcutTree &tree = accel.tree;
+    const CellElement *ce = &tree.elements()[cell.first_element];
+    Counters *stats = tally.counters;
+    uint64_t tests = 0;
+    if (accel.groups.empty()) {
+        for (uint32_t i = cell.n_elements; i-- > 0; ) {
+            const Element &e = accel.elements[ce[i].element];
+            if (stats) tests += count_winding(*stats, tree, ce[i], 1);
+            if (!inside(e.winding_rule, tree.winding(ce[i], x, y))) continue;
+            float er, eg, eb, ea;
+            if (stats) ++stats->paints[paint_kind(e.type)];
+            paint_color(accel, e, x, y, er, eg, eb, ea);
+            float t = 1.f - a;
+            r += t*er; g += t*eg; b += t*eb; a += t*ea;
+            if (a >= opaque_alpha) {
+                a = 1.f;
+                if (stats && i > 0) ++stats->early_exits;
+                break;
+            }
+        }
+        if (stats) {
+            ++stats->samples;
+            tally.count_cell(cell, 1, tests);
+        }
+        return;
+    }
+    // stencils come before the elements they clip, so the clips that
+    // cover the sample are found back to front
+    thread_local ClipStamps clips;
+    clips.next(accel.groups.size());
+    thread_local std::vector<char> covers;
+    covers.assign(cell.n_elements, 0);
+    for (uint32_t i = 0; i < cell.n_elements; ++i) {
+        const Element &e = accel.elements[ce[i].element];
+        if (stats) tests += count_winding(*stats, tree, ce[i], 1);
+        covers[i] = inside(e.winding_rule, tree.winding(ce[i], x, y));
+        if (e.clip >= 0 && covers[i] &&
+            unclipped(accel, clips, e.group, root)) {
+            clips.stamps[e.clip] = clips.current;
+        }
+    }
+    // then the painted elements, in a stack of layers for the groups
+    // between root and each element
+    thread_local std::vector<Layer> layers;
+    thread_local std::vector<int32_t> path;
+    layers.assign(1, Layer{r, g, b, a, root, false});
+    auto pop = [&](void) {
+        Layer l = layers.back();
+        layers.pop_back();
+        Layer &p = layers.back();
+        if (l.hidden) return;
+        const Group &group = accel.groups[l.group];
+        float t = (1.f - p.a)*(group.kind == Group::Kind::fade?
+            group.opacity: 1.f);
+        p.r += t*l.r; p.g += t*l.g; p.b += t*l.b; p.a += t*l.a;
+        if (p.a >= opaque_alpha) p.a = 1.f;
+    };
+    for (uint32_t i = cell.n_elements; i-- > 0; ) {
+        const Element &e = accel.elements[ce[i].element];
+        if (e.clip >= 0 || !covers[i]) continue;
+        // leave the layers of groups that do not contain e
+        while (!contains(accel, layers.back().group, e.group)) pop();
+        // and enter those between the current layer and e
+        path.clear();
+        for (int32_t q = e.group; q != layers.back().group;
+            q = accel.groups[q].parent) {
+            path.push_back(q);
+        }
+        for (size_t k = path.size(); k-- > 0; ) {
+            const Layer &p = layers.back();
+            const Group &group = accel.groups[path[k]];
+            bool hidden = p.hidden || p.a >= opaque_alpha ||
+                (group.kind == Group::Kind::clip &&
+                 clips.stamps[path[k]] != clips.current);
+            layers.push_back(Layer{0.f, 0.f, 0.f, 0.f, path[k], hidden});
+        }
+        Layer &l = layers.back();
+        if (l.hidden || l.a >= opaque_alpha) {
+            if (layers.size() == 1) break;
+            continue;
+        }
+        float er, eg, eb, ea;
+        if (stats) ++stats->paints[paint_kind(e.type)];
+        paint_color(accel, e, x, y, er, eg, eb, ea);
+        float t = 1.f - l.a;
+        l.r += t*er; l.g += t*eg; l.b += t*eb; l.a += t*ea;
+        if (l.a >= opaque_alpha) {
+            l.a = 1.f;
+            if (layers.size() == 1) {
+                if (stats && i > 0) ++stats->early_exits;
+                break;
+            }
+        }
+    }
+    if (stats) {
+        ++stats->samples;
+        tally.count_cell(cell, 1, tests);
+    }
+    while (layers.size() > 1) pop();
+    const Layer &l = layers.back();
+    r = l.r; g = l.g; b = l.b; a = l.a;
+}
+
+// Finds the leaf containing the sample and composites every element
+// that covers it over the background
+static Pixel sample(const Accelerated &accel, const Tally &tally, float x,
+    float y) {
+    float r = 0.f, g = 0.f, b = 0.f, a = 0.f;
+    const ShortcutTree &tree = accel.tree;
+    Counters *stats = tally.counters;
+    if (tree.contains(x, y)) {
+        if (stats) ++stats->cells;
+        composite(accel, tally, tree.locate(x, y), x, y, -1, r, g, b, a);
+    } else if (stats) {
+        ++stats->samples;
+    }
+    // composite over white background
+    float t = 1.f - a;
+    return Pixel(r + t, g + t, b + t, 1.f);
+}
+
+// Same as sample, for a packet of samples inside the same leaf. The
+// winding numbers of each element are computed for all samples at once.
+// Scenes with groups are composited sample by sample.
+static void sample_packet(const Accelerated &accel, const Tally &tally,
+    PacketWinding winding, const Cell &cell, const Packet &packet, int n,
+    Pixel *pixels) {
+    float r[packet_size] = {0.f}, g[packet_size] = {0.f},
+        b[packet_size] = {0.f}, a[packet_size] = {0.f};
+    Counters *stats = tally.counters;
+    if (stats) ++stats->cells;
+    if (!accel.groups.empty()) {
+        for (int k = 0; k < n; ++k) {
+            composite(accel, tally, cell, packet.x[k], packet.y[k], -1,
+                r[k], g[k], b[k], a[k]);
+        }
+    } else {
+        bool done[packet_size] = {false};
+        int left = n;
+        uint64_t tests = 0;
+        const ShortcutTree &tree = accel.tree;
+        const CellElement *ce = &tree.elements()[cell.first_element];
+        for (uint32_t i = cell.n_elements; i-- > 0 && left > 0; ) {
+            const Element &e = accel.elements[ce[i].element];
+            int32_t w[packet_size];
+            if (stats) tests += count_winding(*stats, tree, ce[i], left);
+            winding(tree, ce[i], packet, w);
+            for (int k = 0; k < n; ++k) {
+                if (done[k] || !inside(e.winding_rule, w[k])) continue;
+                float er, eg, eb, ea;
+                if (stats) ++stats->paints[paint_kind(e.type)];
+                paint_color(accel, e, packet.x[k], packet.y[k],
+                    er, eg, eb, ea);
+                float t = 1.f - a[k];
+                r[k] += t*er; g[k] += t*eg; b[k] += t*eb; a[k] += t*ea;
+                if (a[k] >= opaque_alpha) {
+                    a[k] = 1.f;
+                    done[k] = true;
+                    --left;
+                    if (stats && i > 0) ++stats->early_exits;
+                }
+            }
+        }
+        if (stats) {
+            stats->samples += n;
+            tally.count_cell(cell, n, tests);
+        }
+    }
+    for (int k = 0; k < n; ++k) {
+        // composite over white background
+        float t = 1.f - a[k];
+        pixels[k] = Pixel(r[k] + t, g[k] + t, b[k] + t, 1.f);
+    }
+}
+
+// Renders elements [first, last) of a flattened scene, composited into
+// group root, at the centers of the pixels of a layer covering box at
+// the given scale. The layer has premultiplied RGBA pixels, rows going
+// up, and is transparent wherever nothing covers it.
+static void render_layer(const Flattened &flat, size_t first, size_t last,
+    int32_t root, const int box[4], float scale, int threads,
+    std::vector<float> &image) {
+    uint32_t base = flat.offsets[first];
+    std::vector<Segment> segments(flat.segments.begin() + base,
+        flat.segments.begin() + flat.offsets[last]);
+    std::vector<uint32_t> offsets;
+    for (size_t e = first; e <= last; ++e) {
+        offsets.push_back(flat.offsets[e] - base);
+    }
+    std::vector<Element> elements(flat.elements.begin() + first,
+        flat.elements.begin() + last);
+    std::vector<char> opaque(elements.size());
+    for (size_t e = 0; e < elements.size(); ++e) {
+        opaque[e] = is_opaque(elements[e], flat.ramps.data(),
+            flat.textures.data(), flat.texels.data());
+    }
+    Accelerated layer;
+    TreeParams params;
+    params.threads = threads;
+    layer.tree.build(segments, offsets, static_cast<float>(box[0]),
+        static_cast<float>(box[1]), static_cast<float>(box[2]),
+        static_cast<float>(box[3]), params,
+        [&elements](uint32_t e, int w) {
+            return inside(elements[e].winding_rule, w);
+        },
+        [&opaque](uint32_t e) { return opaque[e] != 0; });
+    layer.elements = Array<Element>(std::move(elements));
+    layer.stops = Array<Stop>(flat.stops.data(), flat.stops.size());
+    layer.ramps = Array<RampColor>(flat.ramps.data(), flat.ramps.size());
+    layer.textures = Array<Texture>(flat.textures.data(),
+        flat.textures.size());
+    layer.texels = Array<float>(flat.texels.data(), flat.texels.size());
+    layer.groups = Array<Group>(flat.groups.data(), flat.groups.size());
+    int w = std::max(1, static_cast<int>(std::ceil((box[2]-box[0])*scale)));
+    int h = std::max(1, static_cast<int>(std::ceil((box[3]-box[1])*scale)));
+    image.assign(4*static_cast<size_t>(w)*h, 0.f);
+    parallel_for(h, threads, [&](int i) {
+        float y = static_cast<float>(box[1]) + (static_cast<float>(i)+.5f)/
+            scale;
+        float *row = &image[4*static_cast<size_t>(i)*w];
+        for (int j = 0; j < w; ++j) {
+            float x = static_cast<float>(box[0]) +
+                (static_cast<float>(j)+.5f)/scale;
+            if (!layer.tree.contains(x, y)) continue;
+            float *p = row + 4*j;
+            composite(layer, Tally{nullptr, nullptr},
+                layer.tree.locate(x, y), x, y, root,
+                p[0], p[1], p[2], p[3]);
+        }
+    });
+}
+
+// Samples n points, gathering runs of consecutive points that fall into
+// the same leaf into packets
+static void sample_points(const Accelerated &accel, const Tally &tally,
+    PacketWinding winding, const float *x, const float *y, int n,
+    Pixel *pixels) {
+    int j = 0;
+    while (j < n) {
+        if (!accel.tree.contains(x[j], y[j])) {
+            pixels[j] = sample(accel, tally, x[j], y[j]);
+            ++j;
+            continue;
+        }
+        const Cell &cell = accel.tree.locate(x[j], y[j]);
+        Packet packet;
+        int m = 0;
+        while (m < packet_size && j+m < n) {
+            float xm = x[j+m], ym = y[j+m];
+            if (xm < cell.xmin || xm >= cell.xmax ||
+                ym < cell.ymin || ym >= cell.ymax) {
+                break;
+            }
+            packet.x[m] = xm;
+            packet.y[m] = ym;
+            ++m;
+        }
+        for (int k = m; k < packet_size; ++k) {
+            packet.x[k] = packet.x[0];
+            packet.y[k] = packet.y[0];
+        }
+        sample_packet(accel, tally, winding, cell, packet, m, pixels+j);
+        j += m;
+    }
+}
+
+// Blends samples 0 to k-1 of a pixel, and samples k to n-1 if rest is
+// given, in gamma space. Returns false if their weights add up to zero.
+static bool resolve(const SamplingPattern &pattern, const GammaTable &gamma,
+    const Pixel *first, int k, const Pixel *rest, Pixel &pixel) {
+    int n = pattern.size();
+    if (n == 1) {
+        pixel = first[0];
+        return true;
+    }
+    float sr = 0.f, sg = 0.f, sb = 0.f, sa = 0.f, sw = 0.f;
+    for (int s = 0; s < (rest? n: k); ++s) {
+        float r, g, b, a;
+        std::tie(r, g, b, a) = s < k? first[s]: rest[s-k];
+        float w = pattern.w[s];
+        sr += w*gamma.encode(r);
+        sg += w*gamma.encode(g);
+        sb += w*gamma.encode(b);
+        sa += w*gamma.encode(a);
+        sw += w;
+    }
+    if (!(sw > 0.f)) return false;
+    pixel = Pixel(GammaTable::decode(sr/sw), GammaTable::decode(sg/sw),
+        GammaTable::decode(sb/sw), GammaTable::decode(sa/sw));
+    return true;
+}
+
+// Largest difference between samples in any channel
+static float contrast(const Pixel *pixels, int n) {
+    float lo[4] = {1.f, 1.f, 1.f, 1.f}, hi[4] = {0.f, 0.f, 0.f, 0.f};
+    for (int s = 0; s < n; ++s) {
+        float c[4];
+        std::tie(c[0], c[1], c[2], c[3]) = pixels[s];
+        for (int i = 0; i < 4; ++i) {
+            lo[i] = std::min(lo[i], c[i]);
+            hi[i] = std::max(hi[i], c[i]);
+        }
+    }
+    float d = 0.f;
+    for (int i = 0; i < 4; ++i) d = std::max(d, hi[i] - lo[i]);
+    return d;
+}
+
+// An element paints a smooth color if its paint has no discontinuities:
+// solid colors, and gradients that neither repeat nor have hard stops
+static std::vector<char> smooth_elements(const Accelerated &accel) {
+    std::vector<char> smooth(accel.elements.size(), 0);
+    for (size_t i = 0; i < accel.elements.size(); ++i) {
+        const Element &e = accel.elements[i];
+        if (e.type == Paint::Type::solid_color) {
+            smooth[i] = 1;
+        } else if ((e.type == Paint::Type::linear_gradient ||
+            e.type == Paint::Type::radial_gradient) &&
+            e.spread != Spread::repeat) {
+            const Stop *stops = accel.stops.data() + e.first_stop;
+            bool hard = false;
+            for (uint32_t k = 1; k < e.n_stops; ++k) {
+                hard = hard || stops[k].offset <= stops[k-1].offset;
+            }
+            smooth[i] = !hard;
+        }
+    }
+    return smooth;
+}
+
+// Returns true if the same elements, in the same order, cover the
+// samples of leaves a and b. Neither may have segments or shortcuts
+// left, so that each element covers all samples of a leaf or none.
+static bool same_cover(const Accelerated &accel, const Cell &a,
+    const Cell &b) {
+    const ShortcutTree &tree = accel.tree;
+    const CellElement *pa = &tree.elements()[a.first_element];
+    const CellElement *pb = &tree.elements()[b.first_element];
+    const CellElement *ea = pa + a.n_elements, *eb = pb + b.n_elements;
+    auto covering = [&accel](const CellElement *p, const CellElement *e) {
+        while (p != e && !inside(accel.elements[p->element].winding_rule,
+            p->winding)) {
+            ++p;
+        }
+        return p;
+    };
+    for ( ;; ) {
+        pa = covering(pa, ea);
+        pb = covering(pb, eb);
+        if (pa == ea || pb == eb) return pa == ea && pb == eb;
+        if (pa->element != pb->element) return false;
+        ++pa; ++pb;
+    }
+}
+
+// Returns true if no segment, and no paint discontinuity, comes near any
+// sample in the box, so that a single sample stands for all of them.
+// Segments on the border between two leaves turn into shortcuts or
+// winding increments on either side, so the leaves must also agree on
+// which elements cover them.
+static bool is_flat(const Accelerated &accel, const std::vector<char> &smooth,
+    float xmin, float ymin, float xmax, float ymax) {
+    const ShortcutTree &tree = accel.tree;
+    // the background outside the tree may differ from what is inside
+    if (!tree.contains(xmin, ymin) || !tree.contains(xmax, ymax)) {
+        return false;
+    }
+    const Cell *first = nullptr;
+    return tree.all_leaves(xmin, ymin, xmax, ymax, [&](const Cell &c) {
+        const CellElement *ce = &tree.elements()[c.first_element];
+        for (uint32_t i = 0; i < c.n_elements; ++i) {
+            if (ce[i].n_segments > 0 || ce[i].n_shortcuts > 0 ||
+                !smooth[ce[i].element]) {
+                return false;
+            }
+        }
+        if (!first) first = &c;
+        return same_cover(accel, *first, c);
+    });
+}
+
+// First index in [lo,hi) whose center is at least v, or hi. Centers
+// grow with the index.
+template <typename CENTER>
+static int first_at_least(int lo, int hi, CENTER center, float v) {
+    while (lo < hi) {
+        int mid = lo + (hi-lo)/2;
+        if (center(mid) < v) lo = mid+1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Constant color of a leaf, or null if its samples must be taken
+static const Fill *leaf_fill(const Accelerated &accel, const Cell &c) {
+    if (accel.fills.empty()) return nullptr;
+    const Fill &f = accel.fills[&c - accel.tree.cells().data()];
+    return f.a >= 0.f? &f: nullptr;
+}
+
+// If every sample in the box falls in leaves of the same constant color,
+// stores it in fill and returns true
+static bool uniform_fill(const Accelerated &accel, float xmin, float ymin,
+    float xmax, float ymax, Fill &fill) {
+    const ShortcutTree &tree = accel.tree;
+    if (!tree.contains(xmin, ymin) || !tree.contains(xmax, ymax)) {
+        return false;
+    }
+    const Fill *first = nullptr;
+    bool same = tree.all_leaves(xmin, ymin, xmax, ymax, [&](const Cell &c) {
+        const Fill *f = leaf_fill(accel, c);
+        if (!f) return false;
+        if (!first) first = f;
+        return f->r == first->r && f->g == first->g && f->b == first->b &&
+            f->a == first->a;
+    });
+    if (!same || !first) return false;
+    fill = *first;
+    return true;
+}
+
+// Samples the center of each pixel in rows [i0,i1) and columns [j0,j1)
+// leaf by leaf. Each leaf overlapping the block is visited once, and the
+// pixels with centers in it are sampled together as packets, so no
+// sample needs to look for its leaf. Leaves of constant color are filled
+// without sampling at all.
+static void render_cells(const Accelerated &accel, const Tally &tally,
+    PacketWinding winding, int xmin, int ymin, float tx, float ty, int i0,
+    int i1, int j0, int j1, Band &img) {
+    const ShortcutTree &tree = accel.tree;
+    auto cx = [&](int j) { return static_cast<float>(xmin+j)+.5f-tx; };
+    auto cy = [&](int i) { return static_cast<float>(ymin+i)+.5f-ty; };
+    // pixels outside the tree see only the background
+    for (int i = i0; i < i1; ++i) {
+        for (int j = j0; j < j1; ++j) {
+            if (!tree.contains(cx(j), cy(i))) {
+                float r, g, b, a;
+                std::tie(r, g, b, a) = sample(accel, tally, cx(j), cy(i));
+                img.set_pixel(j, i, r, g, b, a);
+            }
+        }
+    }
+    tree.all_leaves(cx(j0), cy(i0), cx(j1-1), cy(i1-1), [&](const Cell &c) {
+        int ja = first_at_least(j0, j1, cx, c.xmin);
+        int jb = first_at_least(ja, j1, cx, c.xmax);
+        int ia = first_at_least(i0, i1, cy, c.ymin);
+        int ib = first_at_least(ia, i1, cy, c.ymax);
+        const Fill *f = leaf_fill(accel, c);
+        if (f) {
+            img.fill(ja, jb, ia, ib, f->r, f->g, f->b, f->a);
+            if (Counters *stats = tally.counters) {
+                ++stats->cells;
+                stats->filled += static_cast<uint64_t>(jb-ja)*(ib-ia);
+            }
+            return true;
+        }
+        int w = jb-ja, n = w*(ib-ia);
+        for (int first = 0; first < n; first += packet_size) {
+            int m = std::min(packet_size, n-first);
+            Packet packet;
+            for (int k = 0; k < packet_size; ++k) {
+                int q = first + std::min(k, m-1);
+                packet.x[k] = cx(ja + q%w);
+                packet.y[k] = cy(ia + q/w);
+            }
+            Pixel pixels[packet_size];
+            sample_packet(accel, tally, winding, c, packet, m, pixels);
+            for (int k = 0; k < m; ++k) {
+                float r, g, b, a;
+                std::tie(r, g, b, a) = pixels[k];
+                img.set_pixel(ja + (first+k)%w, ia + (first+k)/w,
+                    r, g, b, a);
+            }
+        }
+        return true;
+    });
+}
+
+// Number of samples taken first in adaptive mode, before deciding if a
+// pixel needs the rest of the pattern
+constexpr int adaptive_first = 4;
+
+// Splits a band of the image into tiles, and lets a pool of threads
+// sample each pixel of each tile, with the scene translated by (tx, ty). With a
+// single sample per pixel, tiles are traversed leaf by leaf. Every pixel
+// depends only on its own samples, so the output does not depend on the
+// number of threads or on the order of tiles.
+//
+// In adaptive mode, pixels whose samples all fall where nothing changes
+// get a single sample at their center. The others get the first few
+// samples of the pattern, and the rest only if those differ by more than
+// the contrast threshold.
+static void render_band(const Accelerated &accel, int xmin, int ymin,
+    float tx, float ty, const Options &options,
+    const SamplingPattern &pattern, RenderStats *stats, Band &img, int width,
+    std::atomic<int> &done, int n_tiles) {
+    int tile = options.tile;
+    int tiles_x = (width+tile-1)/tile;
+    int tiles_y = (img.rows()+tile-1)/tile;
+    int spp = pattern.size();
+    bool adaptive = options.adaptive >= 0.f && spp > 1;
+    int k = adaptive? std::min(spp, adaptive_first): spp;
+    float rx, ry;
+    pattern.reach(rx, ry);
+    std::vector<char> smooth;
+    if (adaptive) smooth = smooth_elements(accel);
+    static const PacketWinding winding = select_packet_winding();
+    static const GammaTable gamma;
+    int height = img.first()+img.rows();
+    parallel_for(tiles_x*tiles_y, options.threads, [&](int t) {
+        int i0 = img.first()+(t/tiles_x)*tile, j0 = (t%tiles_x)*tile;
+        int i1 = std::min(i0+tile, height), j1 = std::min(j0+tile, width);
+        Tally tally = thread_tally(stats);
+        if (spp == 1) {
+            render_cells(accel, tally, winding, xmin, ymin, tx, ty, i0, i1,
+                j0, j1, img);
+        } else {
+            int w = j1-j0;
+            std::vector<float> x(w*spp), y(w*spp);
+            std::vector<Pixel> first(w*k), rest(w*(spp-k));
+            std::vector<int> flat, edge, refine;
+            for (int i = i0; i < i1; ++i) {
+                float cy = static_cast<float>(ymin+i)+.5f-ty;
+                auto cx = [&](int j) {
+                    return static_cast<float>(xmin+j)+.5f-tx;
+                };
+                flat.clear(); edge.clear(); refine.clear();
+                for (int j = j0; j < j1; ++j) {
+                    // pixels whose samples all get the same color
+                    Fill f;
+                    if (uniform_fill(accel, cx(j)-rx, cy-ry, cx(j)+rx,
+                        cy+ry, f)) {
+                        img.set_pixel(j, i, f.r, f.g, f.b, f.a);
+                        if (tally.counters) ++tally.counters->filled;
+                    } else if (adaptive && is_flat(accel, smooth, cx(j)-rx,
+                        cy-ry, cx(j)+rx, cy+ry)) {
+                        flat.push_back(j);
+                    } else {
+                        edge.push_back(j);
+                    }
+                }
+                // single samples at the center of flat pixels
+                for (size_t m = 0; m < flat.size(); ++m) {
+                    x[m] = cx(flat[m]);
+                    y[m] = cy;
+                }
+                sample_points(accel, tally, winding, x.data(), y.data(),
+                    static_cast<int>(flat.size()), first.data());
+                for (size_t m = 0; m < flat.size(); ++m) {
+                    float r, g, b, a;
+                    std::tie(r, g, b, a) = first[m];
+                    img.set_pixel(flat[m], i, r, g, b, a);
+                }
+                // first k samples of every other pixel, one after the other
+                for (size_t m = 0; m < edge.size(); ++m) {
+                    for (int s = 0; s < k; ++s) {
+                        x[m*k+s] = cx(edge[m]) + pattern.dx[s];
+                        y[m*k+s] = cy + pattern.dy[s];
+                    }
+                }
+                sample_points(accel, tally, winding, x.data(), y.data(),
+                    static_cast<int>(edge.size())*k, first.data());
+                for (size_t m = 0; m < edge.size(); ++m) {
+                    const Pixel *p = &first[m*k];
+                    Pixel pixel;
+                    if ((k < spp && contrast(p, k) > options.adaptive) ||
+                        !resolve(pattern, gamma, p, k, nullptr, pixel)) {
+                        refine.push_back(static_cast<int>(m));
+                        continue;
+                    }
+                    float r, g, b, a;
+                    std::tie(r, g, b, a) = pixel;
+                    img.set_pixel(edge[m], i, r, g, b, a);
+                }
+                // rest of the pattern where the first samples disagree
+                int n = spp-k;
+                for (size_t m = 0; m < refine.size(); ++m) {
+                    float px = cx(edge[refine[m]]);
+                    for (int s = k; s < spp; ++s) {
+                        x[m*n+s-k] = px + pattern.dx[s];
+                        y[m*n+s-k] = cy + pattern.dy[s];
+                    }
+                }
+                sample_points(accel, tally, winding, x.data(), y.data(),
+                    static_cast<int>(refine.size())*n, rest.data());
+                for (size_t m = 0; m < refine.size(); ++m) {
+                    Pixel pixel(1.f, 1.f, 1.f, 1.f);
+                    resolve(pattern, gamma, &first[refine[m]*k], k,
+                        rest.data() + m*n, pixel);
+                    float r, g, b, a;
+                    std::tie(r, g, b, a) = pixel;
+                    img.set_pixel(edge[refine[m]], i, r, g, b, a);
+                }
+            }
+        }
+        int d = ++done;
+        if (1000*d/n_tiles != 1000*(d-1)/n_tiles) {
+fprintf(stderr, "\r%5g%%", std::floor(1000.f*d/n_tiles)/10.f);
+        }
+    });
+}
+
+// Bands of rows a frame is split into, from the top of the image down,
+// that may exist at the same time: one being rendered, one waiting and
+// one being encoded
+constexpr int band_window = 3;
+
+// Builds a tree over box from the flattened scene in an out-of-core
+// accel. Only segments that cross some row of the box to the right of
+// its left edge can change the winding number of a sample in it, so the
+// others are culled before the tree is built. Everything else refers to
+// the arrays in accel.
+static void cull(const Accelerated &accel, const std::vector<char> &opaque,
+    const float box[4], const TreeParams &params, Accelerated &culled) {
+    std::vector<Segment> segments;
+    std::vector<uint32_t> offsets(1, 0);
+    for (size_t e = 0; e+1 < accel.offsets.size(); ++e) {
+        for (uint32_t i = accel.offsets[e]; i < accel.offsets[e+1]; ++i) {
+            const Segment &s = accel.segments[i];
+            if (s.ymax > box[1] && s.ymin < box[3] && s.xmax > box[0]) {
+                segments.push_back(s);
+            }
+        }
+        offsets.push_back(static_cast<uint32_t>(segments.size()));
+    }
+    const Array<Element> &elements = accel.elements;
+    culled.tree.build(segments, offsets, box[0], box[1], box[2], box[3],
+        params, [&elements](uint32_t e, int w) {
+            return inside(elements[e].winding_rule, w);
+        }, [&opaque](uint32_t e) { return opaque[e] != 0; });
+    culled.elements = Array<Element>(elements.data(), elements.size());
+    culled.stops = Array<Stop>(accel.stops.data(), accel.stops.size());
+    culled.ramps = Array<RampColor>(accel.ramps.data(), accel.ramps.size());
+    culled.textures = Array<Texture>(accel.textures.data(),
+        accel.textures.size());
+    culled.texels = Array<float>(accel.texels.data(), accel.texels.size());
+    culled.groups = Array<Group>(accel.groups.data(), accel.groups.size());
+    fill_cells(culled);
+}
+
+// Seconds a frame spent on each phase
+struct FrameTimes {
+    double culling, rendering, saving;
+};
+
+// Renders a frame band by band, and writes it to out as a png. Each band
+// is encoded while the bands below it are rendered, and only a window
+// of bands is ever held in memory. With an out-of-core accel, each band
+// also gets a tree of its own, over the part of bounds its samples can
+// reach, so that memory does not grow with the viewport either.
+// Returns the time each phase took.
+static FrameTimes render_frame(const Accelerated &accel, const float bounds[4],
+    int xmin, int ymin, float tx, float ty, const Options &options,
+    const SamplingPattern &pattern, RenderStats *stats, int width, int height,
+    FILE *out) {
 Chronos time;
+    bool outofcore = !accel.offsets.empty();
+    TreeParams params = tree_params(options);
+    float rx, ry;
+    pattern.reach(rx, ry);
+    double culling = 0.;
+    std::vector<char> opaque;
+    if (outofcore) {
+        for (const Element &e: accel.elements) {
+            opaque.push_back(is_opaque(e, accel.ramps.data(),
+                accel.textures.data(), accel.texels.data()));
+        }
+    }
+    int tile = options.tile;
+    int band = std::max(1, std::min(options.band, height));
+    int tiles_x = (width+tile-1)/tile;
+    int n_tiles = 0;
+    for (int top = height; top > 0; top -= band) {
+        int rows = std::min(band, top);
+        n_tiles += tiles_x*((rows+tile-1)/tile);
+    }
+    std::atomic<int> done(0);
+    BandEncoder encoder(out, width, height, band_window, options.precision,
+        dither_mask(options.dither));
+    for (int top = height; top > 0; top -= band) {
+        int first = std::max(0, top-band);
+        Band img = encoder.acquire(width, first, top-first);
+        Accelerated culled;
+        if (outofcore) {
+Chronos cull_time;
+            const float box[4] = {
+                std::max(bounds[0], static_cast<float>(xmin)-tx-rx),
+                std::max(bounds[1], static_cast<float>(ymin+first)-ty-ry),
+                std::min(bounds[2], static_cast<float>(xmin+width)-tx+rx),
+                std::min(bounds[3], static_cast<float>(ymin+top)-ty+ry)
+            };
+            cull(accel, opaque, box, params, culled);
+            culling += cull_time.elapsed();
+        }
+        render_band(outofcore? culled: accel, xmin, ymin, tx, ty, options,
+            pattern, stats, img, width, done, n_tiles);
+        encoder.submit(std::move(img));
+    }
+fprintf(stderr, "\n");
+    if (outofcore) {
+fprintf(stderr, "culling in %.3fs\n", culling);
+    }
+    double rendering = time.elapsed();
+fprintf(stderr, "rendering in %.3fs\n", rendering);
+time.reset();
+    encoder.finish();
+    double saving = time.elapsed();
+fprintf(stderr, "saved in %.3fs\n", saving);
+    if (stats) stats->end_frame(tx, ty, culling, rendering, saving);
+    return FrameTimes{culling, rendering, saving};
+}
+
+// Measures the work each pixel of a frame takes, and writes it to out as
+// a png on a log color scale. Samples are taken one at a time, so times
+// are those of scalar sampling, without the packets render_frame uses.
+// Pixels whose samples all fall in leaves of constant color take no
+// tests, as in render_frame. Only the segment and shortcut metrics
+// count, so that times do not include the counting.
+static void render_heatmap(const Accelerated &accel, int xmin, int ymin,
+    float tx, float ty, const Options &options,
+    const SamplingPattern &pattern, int width, int height, FILE *out) {
+Chronos time;
+    const ShortcutTree &tree = accel.tree;
+    float rx, ry;
+    pattern.reach(rx, ry);
+    int spp = pattern.size();
+    std::vector<float> heat(static_cast<size_t>(width)*height, 0.f);
+    bool counting = options.heatmap == HeatMetric::segments ||
+        options.heatmap == HeatMetric::shortcuts;
+    parallel_for(height, options.threads, [&](int i) {
+        float cy = static_cast<float>(ymin+i)+.5f-ty;
+        for (int j = 0; j < width; ++j) {
+            float cx = static_cast<float>(xmin+j)+.5f-tx;
+            Counters counters;
+            Tally tally{counting? &counters: nullptr, nullptr};
+            auto start = std::chrono::steady_clock::now();
+            Fill f;
+            if (!uniform_fill(accel, cx-rx, cy-ry, cx+rx, cy+ry, f)) {
+                for (int s = 0; s < spp; ++s) {
+                    sample(accel, tally, cx + pattern.dx[s],
+                        cy + pattern.dy[s]);
+                }
+            }
+            float ns = std::chrono::duration<float, std::nano>(
+                std::chrono::steady_clock::now() - start).count();
+            float &v = heat[static_cast<size_t>(i)*width + j];
+            switch (options.heatmap) {
+                case HeatMetric::segments:
+                    for (uint64_t n: counters.segments) {
+                        v += static_cast<float>(n);
+                    }
+                    break;
+                case HeatMetric::shortcuts:
+                    v = static_cast<float>(counters.shortcuts);
+                    break;
+                case HeatMetric::depth:
+                    if (tree.contains(cx, cy)) v = tree.locate(cx, cy).depth;
+                    break;
+                case HeatMetric::time:
+                    v = ns;
+                    break;
+                default:
+                    break;
+            }
+        }
+    });
+    float max = 0.f;
+    for (float v: heat) max = std::max(max, v);
+fprintf(stderr, "heatmap in %.3fs, at most %g %s per pixel\n", time.elapsed(),
+    max, heat_metric_unit(options.heatmap));
+time.reset();
+    // rows go up, the png goes down
+    PngWriter png(out, width, height);
+    std::vector<uint8_t> row(4*static_cast<size_t>(width));
+    for (int i = height; i-- > 0; ) {
+        for (int j = 0; j < width; ++j) {
+            heat_color(heat[static_cast<size_t>(i)*width + j], max,
+                &row[4*j]);
+            row[4*j+3] = 255;
+        }
+        png.write_row(row.data());
+    }
+    png.finish();
+fprintf(stderr, "saved in %.3fs\n", time.elapsed());
+}
+
+// Replaces %x and %y in the pattern by the translation of the frame
+static std::string frame_name(const std::string &pattern, float tx,
+    float ty) {
+    std::string name;
+    for (size_t i = 0; i < pattern.size(); ++i) {
+        if (pattern[i] == '%' && i+1 < pattern.size() &&
+            (pattern[i+1] == 'x' || pattern[i+1] == 'y')) {
+            char value[32];
+            snprintf(value, sizeof(value), "%g", pattern[i+1] == 'x'? tx: ty);
+            name += value;
+            ++i;
+        } else {
+            name += pattern[i];
+        }
+    }
+    return name;
+}
+
+// Renders one frame per combination of the translations in -tx and -ty.
+// A single frame goes to out. Several frames need -frames:<pattern>,
+// and each goes to its own file, all sampled from the same accel.
+void render(const Accelerated &accel, const Viewport &vp, FILE *out,
+    const std::vector<std::string> &args, const std::vector<float> &pattern) {
+    Options options = parse_args(args);
+    if (options.pattern > 0 && pattern.empty()) {
+        throw std::invalid_argument("-pattern needs sample offsets");
+    }
+    SamplingPattern sampling = make_sampling_pattern(pattern,
+        options.filter, options.radius);
+    size_t n_frames = options.tx.size()*options.ty.size();
+    if (n_frames > 1 && options.frames.empty()) {
+        throw std::invalid_argument("multiple translations need -frames");
+    }
     // Get viewport
     int xl, yb, xr, yt;
     std::tie(xl, yb) = vp.bl();
@@ -54,26 +2105,80 @@ Chronos time;
     int height = std::abs(yt-yb);
     int xmin = std::min(xl, xr);
     int ymin = std::min(yt, yb);
-    // Allocate image
-    rvg::image::Image<float, 4> img;
-    img.resize(width, height);
-    // Rendering loop
-time.reset();
-    for (int i = 0; i < height; ++i) {
-        float y = static_cast<float>(ymin+i)+.5f;
-fprintf(stderr, "\r%5g%%", std::floor(1000.f*(i+1)/height)/10.f);
-        for (int j = 0; j < width; j++) {
-            float x = static_cast<float>(xmin+j)+.5f;
-            float r, g, b, a;
-            std::tie(r, g, b, a) = sample(accel, x, y);
-            img.set_pixel(j, i, r, g, b, a);
+    float bounds[4];
+    tree_bounds(vp, options, bounds);
+    bool heatmap = options.heatmap != HeatMetric::none;
+    if (heatmap && !accel.offsets.empty()) {
+        throw std::invalid_argument("-heatmap needs a tree, not -outofcore");
+    }
+    // a heatmap in place of the image renders no frames to report on
+    if (heatmap && options.heatmap_file.empty() &&
+        (!options.stats.empty() || !options.times.empty())) {
+        throw std::invalid_argument("-stats and -times need the image, "
+            "so -heatmap needs a file of its own");
+    }
+    std::unique_ptr<RenderStats> stats;
+    if (!options.stats.empty()) stats.reset(new RenderStats(accel.tree));
+    std::unique_ptr<FILE, int (*)(FILE *)> times(nullptr, fclose);
+    if (!options.times.empty()) {
+        times.reset(fopen(options.times.c_str(), "w"));
+        if (!times) {
+            throw std::runtime_error("unable to open " + options.times);
         }
+        fprintf(times.get(), "tx\tty\tculling\trendering\tsaving\n");
+    }
+    // the image, or the heatmap in its place
+    auto frame = [&](float tx, float ty, FILE *f) {
+        if (heatmap && options.heatmap_file.empty()) {
+            render_heatmap(accel, xmin, ymin, tx, ty, options, sampling,
+                width, height, f);
+        } else {
+            FrameTimes t = render_frame(accel, bounds, xmin, ymin, tx, ty,
+                options, sampling, stats.get(), width, height, f);
+            if (times) {
+                fprintf(times.get(), "%g\t%g\t%.6f\t%.6f\t%.6f\n", tx, ty,
+                    t.culling, t.rendering, t.saving);
+            }
+        }
+    };
+    auto to_file = [](const std::string &name,
+        const std::function<void(FILE *)> &write) {
+        FILE *f = fopen(name.c_str(), "wb");
+        if (!f) throw std::runtime_error("unable to open " + name);
+        try {
+            write(f);
+        } catch (...) {
+            fclose(f);
+            throw;
+        }
+        fclose(f);
+    };
+    for (float tx: options.tx) {
+        for (float ty: options.ty) {
+            if (options.frames.empty()) {
+                frame(tx, ty, out);
+            } else {
+                to_file(frame_name(options.frames, tx, ty), [&](FILE *f) {
+                    frame(tx, ty, f);
+                });
+            }
+            // and the heatmap alongside it
+            if (heatmap && !options.heatmap_file.empty()) {
+                to_file(frame_name(options.heatmap_file, tx, ty),
+                    [&](FILE *f) {
+                    render_heatmap(accel, xmin, ymin, tx, ty, options,
+                        sampling, width, height, f);
+                });
+            }
+        }
+    }
+    if (stats && !stats->write(options.stats,
+        static_cast<size_t>(options.hot_cells))) {
+        throw std::runtime_error("unable to write " + options.stats);
+    }
+    if (times && fclose(times.release()) != 0) {
+        throw std::runtime_error("unable to write " + options.times);
     }
-fprintf(stderr, "\n");
-fprintf(stderr, "rendering in %.3fs\n", time.elapsed());
-time.reset();
-    rvg::image::pngio::store<uint8_t>(out, img);
-fprintf(stderr, "saved in %.3fs\n", time.elapsed());
 }
 
 } } } // namespace rvg::driver::png
@@ -82,44 +2187,122 @@ fprintf(stderr, "saved in %.3fs\n", time.elapsed());
 // functions to Lua.
 
 using rvg::driver::png::Accelerated;
+using rvg::driver::png::AcceleratedPtr;
 
-// pushes a new userdata with with an Accelerated object
-template <typename A>
-typename std::enable_if<
-    rvg::meta::forward_same_or_convertible<A, Accelerated>::value,
-int>::type pushaccel(lua_State *L, A &&accel) {
-    Accelerated *p = reinterpret_cast<Accelerated *>(
-        lua_newuserdata(L, sizeof(Accelerated)));
-    new (p) Accelerated(std::forward<A>(accel));
+// pushes a new userdata holding an empty handle to an Accelerated
+// object, and returns the handle
+static AcceleratedPtr &newaccel(lua_State *L) {
+    AcceleratedPtr *p = reinterpret_cast<AcceleratedPtr *>(
+        lua_newuserdata(L, sizeof(AcceleratedPtr)));
+    new (p) AcceleratedPtr();
     lua_pushvalue(L, lua_upvalueindex(2));
     lua_setmetatable(L, -2);
-    return 1;
+    return *p;
 }
 
-// checks and returns an Accelerated object from a userdata
-Accelerated checkaccel(lua_State *L, int idx) {
+// checks and returns an Accelerated object from a userdata. The object
+// is owned by the userdata, so the reference is good for as long as the
+// userdata stays on the stack.
+static const Accelerated &checkaccel(lua_State *L, int idx) {
     idx = compat_abs_index(L, idx);
     if (!lua_getmetatable(L, idx)) lua_pushnil(L);
     if (!compat_is_equal(L, -1, lua_upvalueindex(2)))
         luaL_argerror(L, idx, "expected accelerated (png)");
     lua_pop(L, 1);
-    return *reinterpret_cast<Accelerated *>(lua_touserdata(L, idx));
+    return **reinterpret_cast<AcceleratedPtr *>(lua_touserdata(L, idx));
 }
 
 // Lua version of the rvg::driver::png::accelerate function
 static int luaaccelerate(lua_State *L) {
-   return pushaccel(L, rvg::driver::png::accelerate(
-        rvg::description::lua::checkxformablescene(L, 1),
-        rvg::description::lua::checkviewport(L, 2)));
+    // argument errors longjmp, so every argument is checked before
+    // anything that needs destroying exists, and what the checks return
+    // is thrown away at once
+    rvg::description::lua::checkxformablescene(L, 1);
+    rvg::description::lua::checkviewport(L, 2);
+    rvg::description::lua::optargs(L, 3);
+    // the userdata owns the accel from the start, so there is nothing to
+    // destroy on the stack should lua_error be needed
+    AcceleratedPtr &accel = newaccel(L);
+    bool failed = false;
+    {
+        // these checks already passed once, so they cannot fail now
+        auto scene = rvg::description::lua::checkxformablescene(L, 1);
+        auto vp = rvg::description::lua::checkviewport(L, 2);
+        auto args = rvg::description::lua::optargs(L, 3);
+        try {
+            accel = std::make_shared<const Accelerated>(
+                rvg::driver::png::accelerate(scene, vp, args));
+        } catch (std::exception &e) {
+            // errors cannot unwind through Lua, so report them from here
+            lua_pushstring(L, e.what());
+            failed = true;
+        }
+    }
+    if (failed) return lua_error(L);
+    return 1;
+}
+
+// Reads the sample offsets of blue[n], from the module with the
+// blue-noise patterns the Lua driver uses
+static bool loadpattern(lua_State *L, int n, std::vector<float> &pattern) {
+    lua_getglobal(L, "require");
+    lua_pushstring(L, "blue");
+    if (lua_pcall(L, 1, 1, 0) != 0) {
+        lua_pop(L, 1);
+        return false;
+    }
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        return false;
+    }
+    lua_rawgeti(L, -1, n);
+    bool found = lua_istable(L, -1) != 0;
+    for (int i = 1; found; ++i) {
+        lua_rawgeti(L, -1, i);
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            break;
+        }
+        pattern.push_back(static_cast<float>(lua_tonumber(L, -1)));
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 2);
+    return found;
 }
 
 // Lua version of the rvg::driver::png::render function
 static int luarender(lua_State *L) {
-    rvg::driver::png::render(
-        checkaccel(L, 1),
-        rvg::description::lua::checkviewport(L, 2),
-        compat_check_file(L, 3),
-        rvg::description::lua::optargs(L, 4));
+    bool failed = false;
+    {
+        // argument errors longjmp, so they must not happen inside the try
+        const Accelerated &accel = checkaccel(L, 1);
+        auto vp = rvg::description::lua::checkviewport(L, 2);
+        FILE *file = compat_check_file(L, 3);
+        auto args = rvg::description::lua::optargs(L, 4);
+        int n = 0;
+        try {
+            n = rvg::driver::png::parse_args(args).pattern;
+        } catch (std::exception &e) {
+            lua_pushstring(L, e.what());
+            failed = true;
+        }
+        // patterns live in Lua, so they are loaded here, once per call
+        std::vector<float> pattern;
+        if (!failed && n > 0 && !loadpattern(L, n, pattern)) {
+            lua_pushfstring(L, "no pattern %d in module blue", n);
+            failed = true;
+        }
+        if (!failed) {
+            try {
+                rvg::driver::png::render(accel, vp, file, args, pattern);
+            } catch (std::exception &e) {
+                // errors cannot unwind through Lua, so report them from here
+                lua_pushstring(L, e.what());
+                failed = true;
+            }
+        }
+    }
+    if (failed) return lua_error(L);
     return 0;
 }
 
@@ -132,15 +2315,15 @@ static const luaL_Reg modpng[] = {
 
 // __gc metamethod for Accelerated userdata
 static int gcaccel(lua_State *L) {
-    Accelerated *p = reinterpret_cast<Accelerated*>(lua_touserdata(L, 1));
-    p->~Accelerated();
+    AcceleratedPtr *p = reinterpret_cast<AcceleratedPtr*>(lua_touserdata(L, 1));
+    p->~AcceleratedPtr();
     return 0;
 }
 
 // __tostring metamethod for Accelerated userdata
 static int tostringaccel(lua_State *L) {
-    Accelerated *p = reinterpret_cast<Accelerated*>(lua_touserdata(L, 1));
-    lua_pushfstring(L, "accelerated (png): %p", p);
+    AcceleratedPtr *p = reinterpret_cast<AcceleratedPtr*>(lua_touserdata(L, 1));
+    lua_pushfstring(L, "accelerated (png): %p", p->get());
     return 1;
 }
 
@@ -2,11 +2,19 @@
 #define RVG_DRIVER_PNG_H
 
 #include <vector>
+#include <memory>
 #include <string>
 #include <cstdio>
+#include <cstdint>
 
 #include "bbox/viewport.h"
 #include "scene/xformablescene.h"
+#include "scene/iscene.h"
+#include "paint/paint.h"
+#include "paint/spread.h"
+
+#include "driver/cpp/array.h"
+#include "driver/cpp/shortcut-tree.h"
 
 namespace rvg {
     namespace driver {
@@ -15,16 +23,107 @@ namespace rvg {
 using rvg::scene::XformableScene;
 using rvg::bbox::Viewport;
 
-// Redefine this to be your own acceleration datastructure
-using Accelerated = XformableScene;
+// Color stop of a gradient ramp, with premultiplied color
+struct Stop {
+    float offset;
+    float r, g, b, a;
+};
+
+// Entry of a gradient ramp lookup table, with premultiplied color
+struct RampColor {
+    float r, g, b, a;
+};
+
+// Texture image, converted to premultiplied RGBA, along with its mip
+// pyramid. Rows go up.
+struct Texture {
+    int32_t width, height;
+    int32_t levels;             // mip levels, the image itself included
+    uint64_t first_texel;       // first float in Accelerated::texels
+};
+
+// Clip or fade around a run of consecutive elements, composited as a
+// whole. Groups nest, and each element refers to the innermost group
+// around it. Blurs never show up here: accelerate renders them into
+// textures.
+struct Group {
+    enum class Kind: int32_t {
+        clip,   // elements show only where some stencil of the clip does
+        fade    // elements are composited together, then faded
+    };
+    Kind kind;
+    int32_t parent;             // enclosing group, or -1
+    int32_t depth;              // 1 for groups not inside any other
+    float opacity;              // of fades
+};
+
+// Everything needed to paint one scene element, already mapped to
+// screen space. Colors are premultiplied and include the paint opacity.
+// Elements refer to stops and textures by index, so they can be stored
+// in a file and used from wherever it is mapped.
+struct Element {
+    rvg::scene::WindingRule winding_rule;
+    rvg::paint::Paint::Type type;
+    rvg::paint::Spread spread;
+    float r, g, b, a;           // solid color
+    float ixf[6];               // screen to paint space (affine, row major)
+    float opacity;
+    float x1, y1, x2, y2;       // linear gradient
+    float cx, cy, fx, fy, rr;   // radial gradient
+    uint32_t first_stop, n_stops;
+    uint32_t first_ramp, n_ramp; // ramp table in Accelerated::ramps
+    int32_t texture;            // index into Accelerated::textures, or -1
+    float lod;                  // texture level of detail
+    int32_t group;              // innermost group around it, or -1
+    int32_t clip;               // clip it is a stencil of, or -1 if painted
+};
+
+// Color every sample in a leaf gets, where it does not depend on the
+// sample: no segments or shortcuts are left in the leaf, and only solid
+// colors show through it. Alpha is negative everywhere else.
+struct Fill {
+    float r, g, b, a;
+};
+
+// Shortcut tree over the viewport, along with the elements it refers to.
+// It can be large, so it can be moved but not copied. Out-of-core accels
+// hold the flattened scene instead of the tree, and render builds a tree
+// for each band of the image from it.
+struct Accelerated {
+    ShortcutTree tree;
+    Array<Segment> segments;    // of element e: offsets[e] to offsets[e+1]
+    Array<uint32_t> offsets;
+    Array<Element> elements;
+    Array<Stop> stops;
+    Array<RampColor> ramps;
+    Array<Texture> textures;
+    Array<float> texels;
+    Array<Fill> fills;          // one for each cell of the tree
+    Array<Group> groups;
+    // memory the arrays refer to, when they do not own it
+    std::shared_ptr<const void> storage;
+
+    Accelerated() = default;
+    Accelerated(Accelerated &&) = default;
+    Accelerated &operator=(Accelerated &&) = default;
+    Accelerated(const Accelerated &) = delete;
+    Accelerated &operator=(const Accelerated &) = delete;
+};
+
+// Shared, immutable handle to an acceleration datastructure
+using AcceleratedPtr = std::shared_ptr<const Accelerated>;
 
 // Builds the acceleration datastructure from a scene and a viewport
-Accelerated accelerate(const XformableScene &xs, const Viewport &vp);
+Accelerated accelerate(const XformableScene &xs, const Viewport &vp,
+    const std::vector<std::string> &args = std::vector<std::string>());
 
-// Uses the acceleration datastructure to render scene into viewport
+// Uses the acceleration datastructure to render scene into viewport.
+// Each pixel is supersampled at the offsets x0, y0, x1, y1... in
+// pattern, all in [-1/2,1/2]^2, or only at its center if there are none.
 void render(const Accelerated &accel, const Viewport &vp,
     FILE *out, const std::vector<std::string> &args =
-        std::vector<std::string>());
+        std::vector<std::string>(), const std::vector<float> &pattern =
+        std::vector<float>());
 
 } } } // namespace rvg::driver::png
 
@@ -0,0 +1,549 @@
+#ifndef RVG_DRIVER_PNG_SEGMENT_H
+#define RVG_DRIVER_PNG_SEGMENT_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+namespace rvg {
+    namespace driver {
+        namespace png {
+
+// A segment that is monotonic in both x and y, in screen coordinates.
+// Besides the control points, it holds everything needed to decide
+// whether a horizontal ray cast from a sample towards +x crosses it.
+//
+// Inside the bounding box, the test follows "Massively Parallel Vector
+// Graphics" (Ganacim et al., 2014): the chord decides for samples on
+// the side opposite to the control polygon, the tangent triangle
+// decides for samples beyond it, and the implicit form decides the rest.
+struct Segment {
+    enum class Type: uint8_t {
+        linear,
+        quadratic,
+        rational_quadratic,
+        cubic
+    };
+
+    Type type;
+    int8_t dir;         // +1 if the segment goes up in y, -1 otherwise
+    bool bulge_left;    // control polygon is to the left of the chord
+    float x[4], y[4];   // control points (last one at index degree())
+    float w;            // weight of middle control point (rational only)
+    float xmin, ymin, xmax, ymax;
+    float cx, cy;       // chord, relative to first control point
+    float tri[5];       // two inner edges of the tangent triangle
+    float imp[18];      // linear forms of the implicit equation
+    float w2;           // 4*w*w (conics only)
+    float sign;         // orientation of the implicit equation
+
+    int degree(void) const {
+        switch (type) {
+            case Type::linear: return 1;
+            case Type::cubic: return 3;
+            default: return 2;
+        }
+    }
+
+    // Evaluates the implicit equation at a point relative to x[0], y[0].
+    // F is float, or a vector of floats when testing packets of samples.
+    // Vectors are passed by reference to keep their calling convention
+    // out of the picture.
+    template <typename F>
+    void implicit(const F &dx, const F &dy, F &value) const {
+        const float *l = imp;
+        if (type == Type::cubic) {
+            F l32 = l[0]*dx + l[1]*dy + l[2];
+            F l31 = l[3]*dx + l[4]*dy + l[5];
+            F l30 = l[6]*dx + l[7]*dy + l[8];
+            F l21 = l[9]*dx + l[10]*dy + l[11];
+            F l20 = l[12]*dx + l[13]*dy + l[14];
+            F l10 = l[15]*dx + l[16]*dy + l[17];
+            F m = l30 + l21;
+            value = l32*(m*l10 - l20*l20) - l31*(l31*l10 - l20*l30) +
+                l30*(l31*l20 - m*l30);
+        } else {
+            F t0 = l[0]*dx + l[1]*dy + l[2];
+            F t1 = l[3]*dx + l[4]*dy + l[5];
+            F t2 = l[6]*dx + l[7]*dy + l[8];
+            value = t1*t1 - w2*t0*t2;
+        }
+    }
+
+    float implicit(float dx, float dy) const {
+        float value;
+        implicit<float>(dx, dy, value);
+        return value;
+    }
+
+    // Returns true if the sample is to the left of the segment.
+    // Only meaningful for samples inside the bounding box.
+    bool left_of(float px, float py) const {
+        float dx = px - x[0], dy = py - y[0];
+        bool left = dir*(cx*dy - cy*dx) > 0.f;
+        if (type == Type::linear || left != bulge_left) return left;
+        if (tri[0]*dx + tri[1]*dy < 0.f ||
+            tri[2]*dx + tri[3]*dy + tri[4] < 0.f) return bulge_left;
+        return (sign*implicit(dx, dy) > 0.f) == bulge_left;
+    }
+
+    // Returns true if a ray from the sample towards +x crosses the segment
+    bool crosses(float px, float py) const {
+        if (py < ymin || py >= ymax || px >= xmax) return false;
+        if (px < xmin) return true;
+        return left_of(px, py);
+    }
+
+    // Evaluates the segment at parameter t
+    void at(double t, double &px, double &py) const {
+        double s = 1.-t;
+        switch (type) {
+            case Type::linear:
+                px = s*x[0] + t*x[1];
+                py = s*y[0] + t*y[1];
+                break;
+            case Type::quadratic:
+                px = s*s*x[0] + 2.*s*t*x[1] + t*t*x[2];
+                py = s*s*y[0] + 2.*s*t*y[1] + t*t*y[2];
+                break;
+            case Type::rational_quadratic: {
+                double d = s*s + 2.*s*t*w + t*t;
+                px = (s*s*x[0] + 2.*s*t*w*x[1] + t*t*x[2])/d;
+                py = (s*s*y[0] + 2.*s*t*w*y[1] + t*t*y[2])/d;
+                break;
+            }
+            case Type::cubic:
+                px = s*s*s*x[0] + 3.*s*t*(s*x[1] + t*x[2]) + t*t*t*x[3];
+                py = s*s*s*y[0] + 3.*s*t*(s*y[1] + t*y[2]) + t*t*t*y[3];
+                break;
+        }
+    }
+
+    // Returns the x coordinate of the segment at height py, which is
+    // clamped to the range of the segment
+    float x_at(float py) const {
+        int n = degree();
+        if (py <= ymin) return dir > 0? x[0]: x[n];
+        if (py >= ymax) return dir > 0? x[n]: x[0];
+        if (type == Type::linear) {
+            return x[0] + (py-y[0])*cx/cy;
+        }
+        double a = 0., b = 1., px = x[0], qy = y[0];
+        for (int i = 0; i < 48; ++i) {
+            double t = .5*(a+b);
+            at(t, px, qy);
+            if ((qy < py) == (dir > 0)) a = t;
+            else b = t;
+        }
+        return static_cast<float>(px);
+    }
+
+    // Moves the segment by dx, dy. Everything but the control points and
+    // the bounding box is relative to the first control point.
+    void translate(float dx, float dy) {
+        for (int i = 0; i <= degree(); ++i) {
+            x[i] += dx;
+            y[i] += dy;
+        }
+        xmin += dx; xmax += dx;
+        ymin += dy; ymax += dy;
+    }
+};
+
+namespace detail {
+
+// Real roots of a*t^2 + b*t + c = 0 strictly inside (0, 1)
+inline int roots01(double a, double b, double c, double t[2]) {
+    const double eps = 1e-7;
+    int n = 0;
+    double r[2];
+    if (std::fabs(a) <= 1e-12*(std::fabs(b)+std::fabs(c))) {
+        if (b == 0.) return 0;
+        r[n++] = -c/b;
+    } else {
+        double d = b*b - 4.*a*c;
+        if (d < 0.) return 0;
+        d = std::sqrt(d);
+        double q = -.5*(b + (b < 0.? -d: d));
+        if (q != 0.) r[n++] = c/q;
+        r[n++] = q/a;
+    }
+    int m = 0;
+    for (int i = 0; i < n; ++i) {
+        if (r[i] > eps && r[i] < 1.-eps) t[m++] = r[i];
+    }
+    if (m == 2 && t[0] > t[1]) std::swap(t[0], t[1]);
+    return m;
+}
+
+// Sorts parameters and removes those that are too close together
+inline int unique01(double *t, int n) {
+    for (int i = 1; i < n; ++i) {
+        for (int j = i; j > 0 && t[j] < t[j-1]; --j) std::swap(t[j], t[j-1]);
+    }
+    int m = 0;
+    for (int i = 0; i < n; ++i) {
+        if (m == 0 || t[i] - t[m-1] > 1e-7) t[m++] = t[i];
+    }
+    return m;
+}
+
+inline double cross(double ax, double ay, double bx, double by) {
+    return ax*by - ay*bx;
+}
+
+// Stores the linear form of det([p 1; a 1; b 1]), times k
+inline void det_form(double ax, double ay, double bx, double by, double k,
+    float *l) {
+    l[0] = static_cast<float>(k*(ay - by));
+    l[1] = static_cast<float>(k*(bx - ax));
+    l[2] = static_cast<float>(k*(ax*by - bx*ay));
+}
+
+// Fills in the fields common to all segment types. Returns false if the
+// segment is horizontal, and therefore never crossed by a ray.
+inline bool init_segment(Segment &s) {
+    int n = s.degree();
+    if (s.y[0] == s.y[n]) return false;
+    s.dir = s.y[n] > s.y[0]? 1: -1;
+    s.xmin = std::min(s.x[0], s.x[n]);
+    s.xmax = std::max(s.x[0], s.x[n]);
+    s.ymin = std::min(s.y[0], s.y[n]);
+    s.ymax = std::max(s.y[0], s.y[n]);
+    s.cx = s.x[n] - s.x[0];
+    s.cy = s.y[n] - s.y[0];
+    s.bulge_left = false;
+    s.w2 = 0.f;
+    s.sign = 1.f;
+    return true;
+}
+
+inline void degrade_to_linear(Segment &s) {
+    int n = s.degree();
+    s.x[1] = s.x[n]; s.y[1] = s.y[n];
+    s.type = Segment::Type::linear;
+    s.w = 1.f;
+}
+
+// Sets up the tangent triangle given its apex q, relative to x[0], y[0].
+// Returns false if the triangle is too thin to be worth testing against.
+inline bool init_triangle(Segment &s, double qx, double qy) {
+    double cx = s.cx, cy = s.cy;
+    double area = cross(cx, cy, qx, qy);
+    if (std::fabs(area) <= 1e-6*(cx*cx + cy*cy)) return false;
+    s.bulge_left = s.dir*area > 0.;
+    // edge from first point to apex, oriented to be positive inside
+    double s1 = cross(qx, qy, cx, cy) > 0.? 1.: -1.;
+    s.tri[0] = static_cast<float>(-s1*qy);
+    s.tri[1] = static_cast<float>(s1*qx);
+    // edge from apex to last point, oriented to be positive inside
+    double ex = cx - qx, ey = cy - qy;
+    double s2 = cross(ex, ey, -qx, -qy) > 0.? 1.: -1.;
+    s.tri[2] = static_cast<float>(-s2*ey);
+    s.tri[3] = static_cast<float>(s2*ex);
+    s.tri[4] = static_cast<float>(s2*(ey*qx - ex*qy));
+    return true;
+}
+
+// Conic through (0,0) and (x2,y2) with control point (x1,y1) and weight w,
+// in barycentric form: t1^2 - 4*w^2*t0*t2 = 0
+inline void init_conic(Segment &s) {
+    double x1 = s.x[1]-s.x[0], y1 = s.y[1]-s.y[0];
+    double x2 = s.x[2]-s.x[0], y2 = s.y[2]-s.y[0];
+    if (!init_triangle(s, x1, y1)) {
+        degrade_to_linear(s);
+        return;
+    }
+    det_form(x1, y1, x2, y2, 1., s.imp);
+    det_form(x2, y2, 0., 0., 1., s.imp+3);
+    det_form(0., 0., x1, y1, 1., s.imp+6);
+    s.w2 = 4.f*s.w*s.w;
+    s.sign = 1.f;
+}
+
+// Cubic implicitization by resultants, with sign taken so that the
+// equation is positive on the side of the tangent triangle apex.
+// Returns false if the cubic does not look convex, or if the implicit
+// form cannot be trusted inside the triangle.
+inline bool init_cubic(Segment &s) {
+    double p[4][2];
+    for (int i = 0; i < 4; ++i) {
+        p[i][0] = s.x[i] - s.x[0];
+        p[i][1] = s.y[i] - s.y[0];
+    }
+    // tangent directions at both ends
+    double d0x = p[1][0], d0y = p[1][1];
+    if (d0x*d0x + d0y*d0y <= 1e-12) { d0x = p[2][0]; d0y = p[2][1]; }
+    double d1x = p[3][0]-p[2][0], d1y = p[3][1]-p[2][1];
+    if (d1x*d1x + d1y*d1y <= 1e-12) {
+        d1x = p[3][0]-p[1][0]; d1y = p[3][1]-p[1][1];
+    }
+    double den = cross(d0x, d0y, d1x, d1y);
+    if (den == 0.) return false;
+    double a = cross(p[3][0], p[3][1], d1x, d1y)/den;
+    double b = cross(d0x, d0y, p[3][0], p[3][1])/den;
+    if (a <= 0. || b <= 0.) return false;
+    double qx = a*d0x, qy = a*d0y;
+    if (!init_triangle(s, qx, qy)) {
+        degrade_to_linear(s);
+        return true;
+    }
+    // The implicit form also vanishes on the extension of the curve
+    // beyond [0,1], which must not come back into the triangle. Each
+    // edge line meets the curve at one extra parameter, found from the
+    // power basis coefficients of the curve projected onto the normal.
+    double b1[2], b2[2], b3[2];
+    for (int c = 0; c < 2; ++c) {
+        b1[c] = 3.*p[1][c];
+        b2[c] = 3.*(p[2][c]-2.*p[1][c]);
+        b3[c] = p[3][c]-3.*p[2][c]+3.*p[1][c];
+    }
+    const double e[3][4] = { // edges as pairs of endpoints
+        {0., 0., qx, qy}, {qx, qy, p[3][0], p[3][1]},
+        {p[3][0], p[3][1], 0., 0.}};
+    for (int k = 0; k < 3; ++k) {
+        double nx = e[k][1]-e[k][3], ny = e[k][2]-e[k][0];
+        double d = -(nx*e[k][0] + ny*e[k][1]);
+        double c3 = nx*b3[0] + ny*b3[1];
+        double c2 = nx*b2[0] + ny*b2[1];
+        double c1 = nx*b1[0] + ny*b1[1];
+        if (std::fabs(c3) <= 1e-12*(std::fabs(c2)+std::fabs(c1)+std::fabs(d)))
+            continue;
+        double t = k == 0? -c2/c3: (k == 1? -d/c3: c1/c3);
+        if (t >= 0. && t <= 1.) continue;
+        double px, py;
+        s.at(t, px, py);
+        px -= s.x[0]; py -= s.y[0];
+        double ex = e[k][2]-e[k][0], ey = e[k][3]-e[k][1];
+        double u = ((px-e[k][0])*ex + (py-e[k][1])*ey)/(ex*ex + ey*ey);
+        if (u > -1e-3 && u < 1.+1e-3) return false;
+    }
+    const int ij[6][2] = {{3,2},{3,1},{3,0},{2,1},{2,0},{1,0}};
+    const double k[6] = {3., 3., 1., 9., 3., 3.};
+    for (int l = 0; l < 6; ++l) {
+        const double *pi = p[ij[l][0]], *pj = p[ij[l][1]];
+        det_form(pi[0], pi[1], pj[0], pj[1], k[l], s.imp+3*l);
+    }
+    // reference point halfway between the curve and the apex
+    double mx = 0., my = 0.;
+    s.at(.5, mx, my);
+    mx = .5*(mx - s.x[0] + qx);
+    my = .5*(my - s.y[0] + qy);
+    s.sign = 1.f;
+    s.sign = s.implicit(static_cast<float>(mx), static_cast<float>(my))
+        > 0.f? 1.f: -1.f;
+    return true;
+}
+
+} // namespace detail
+
+// Each of the functions below takes an arbitrary segment, splits it into
+// pieces that are monotonic (and, for cubics, free of inflections), and
+// invokes emit(const Segment &) on each piece that can be crossed by a ray.
+
+template <typename EMIT>
+void emit_linear_segment(float x0, float y0, float x1, float y1,
+    EMIT &&emit) {
+    Segment s;
+    s.type = Segment::Type::linear;
+    s.x[0] = x0; s.y[0] = y0; s.x[1] = x1; s.y[1] = y1;
+    s.w = 1.f;
+    if (detail::init_segment(s)) emit(static_cast<const Segment &>(s));
+}
+
+template <typename EMIT>
+void emit_quadratic_segment(float x0, float y0, float x1, float y1,
+    float x2, float y2, EMIT &&emit) {
+    double t[4];
+    int n = detail::roots01(0., x2-2.*x1+x0, x1-x0, t);
+    n += detail::roots01(0., y2-2.*y1+y0, y1-y0, t+n);
+    n = detail::unique01(t, n);
+    double px[3] = {x0, x1, x2}, py[3] = {y0, y1, y2};
+    double t0 = 0.;
+    for (int i = 0; i <= n; ++i) {
+        double q[3][2];
+        if (i < n) {
+            // split remaining piece at t[i] (de Casteljau)
+            double u = (t[i]-t0)/(1.-t0);
+            double ax = px[0]+u*(px[1]-px[0]), ay = py[0]+u*(py[1]-py[0]);
+            double bx = px[1]+u*(px[2]-px[1]), by = py[1]+u*(py[2]-py[1]);
+            double mx = ax+u*(bx-ax), my = ay+u*(by-ay);
+            q[0][0] = px[0]; q[0][1] = py[0];
+            q[1][0] = ax; q[1][1] = ay;
+            q[2][0] = mx; q[2][1] = my;
+            px[0] = mx; py[0] = my; px[1] = bx; py[1] = by;
+            t0 = t[i];
+        } else {
+            for (int j = 0; j < 3; ++j) { q[j][0] = px[j]; q[j][1] = py[j]; }
+        }
+        Segment s;
+        s.type = Segment::Type::quadratic;
+        for (int j = 0; j < 3; ++j) {
+            s.x[j] = static_cast<float>(q[j][0]);
+            s.y[j] = static_cast<float>(q[j][1]);
+        }
+        s.w = 1.f;
+        if (detail::init_segment(s)) {
+            detail::init_conic(s);
+            emit(static_cast<const Segment &>(s));
+        }
+    }
+}
+
+// The middle control point (x1, y1) is given in homogeneous form,
+// i.e., already multiplied by the weight w1
+template <typename EMIT>
+void emit_rational_quadratic_segment(float x0, float y0, float x1, float y1,
+    float w1, float x2, float y2, EMIT &&emit) {
+    if (w1 <= 0.f) {
+        emit_linear_segment(x0, y0, x2, y2, emit);
+        return;
+    }
+    // homogeneous control points
+    double h[3][3] = {{x0, y0, 1.}, {x1, y1, w1}, {x2, y2, 1.}};
+    // numerator of the derivative of each coordinate is a quadratic;
+    // find its coefficients by evaluating it at 0, 1/2, and 1
+    auto deriv = [&h](int c, double t) {
+        double s = 1.-t;
+        double X = s*s*h[0][c] + 2.*s*t*h[1][c] + t*t*h[2][c];
+        double W = s*s*h[0][2] + 2.*s*t*h[1][2] + t*t*h[2][2];
+        double dX = 2.*(s*(h[1][c]-h[0][c]) + t*(h[2][c]-h[1][c]));
+        double dW = 2.*(s*(h[1][2]-h[0][2]) + t*(h[2][2]-h[1][2]));
+        return dX*W - X*dW;
+    };
+    double t[4];
+    int n = 0;
+    for (int c = 0; c < 2; ++c) {
+        double n0 = deriv(c, 0.), nh = deriv(c, .5), n1 = deriv(c, 1.);
+        n += detail::roots01(2.*n1-4.*nh+2.*n0, 4.*nh-n1-3.*n0, n0, t+n);
+    }
+    n = detail::unique01(t, n);
+    double t0 = 0.;
+    for (int i = 0; i <= n; ++i) {
+        double q[3][3];
+        if (i < n) {
+            double u = (t[i]-t0)/(1.-t0);
+            double a[3], b[3], m[3];
+            for (int c = 0; c < 3; ++c) {
+                a[c] = h[0][c]+u*(h[1][c]-h[0][c]);
+                b[c] = h[1][c]+u*(h[2][c]-h[1][c]);
+                m[c] = a[c]+u*(b[c]-a[c]);
+            }
+            for (int c = 0; c < 3; ++c) {
+                q[0][c] = h[0][c]; q[1][c] = a[c]; q[2][c] = m[c];
+                h[0][c] = m[c]; h[1][c] = b[c];
+            }
+            t0 = t[i];
+        } else {
+            for (int j = 0; j < 3; ++j)
+                for (int c = 0; c < 3; ++c) q[j][c] = h[j][c];
+        }
+        // bring to standard form, with unit end weights
+        Segment s;
+        s.type = Segment::Type::rational_quadratic;
+        for (int j = 0; j < 3; ++j) {
+            s.x[j] = static_cast<float>(q[j][0]/q[j][2]);
+            s.y[j] = static_cast<float>(q[j][1]/q[j][2]);
+        }
+        s.w = static_cast<float>(q[1][2]/std::sqrt(q[0][2]*q[2][2]));
+        if (detail::init_segment(s)) {
+            detail::init_conic(s);
+            emit(static_cast<const Segment &>(s));
+        }
+    }
+}
+
+namespace detail {
+
+template <typename EMIT>
+void emit_convex_cubic(const double p[4][2], int depth, EMIT &&emit) {
+    Segment s;
+    s.type = Segment::Type::cubic;
+    for (int j = 0; j < 4; ++j) {
+        s.x[j] = static_cast<float>(p[j][0]);
+        s.y[j] = static_cast<float>(p[j][1]);
+    }
+    s.w = 1.f;
+    if (!init_segment(s)) return;
+    // cubics that are really quadratics have a degenerate implicit form
+    double ex = p[3][0]-3.*p[2][0]+3.*p[1][0]-p[0][0];
+    double ey = p[3][1]-3.*p[2][1]+3.*p[1][1]-p[0][1];
+    double len = std::sqrt(double(s.cx)*s.cx + double(s.cy)*s.cy);
+    if (std::sqrt(ex*ex + ey*ey) <= 1e-3*std::max(1., len)) {
+        s.type = Segment::Type::quadratic;
+        s.x[1] = static_cast<float>(.25*(3.*(p[1][0]+p[2][0])-p[0][0]-p[3][0]));
+        s.y[1] = static_cast<float>(.25*(3.*(p[1][1]+p[2][1])-p[0][1]-p[3][1]));
+        s.x[2] = s.x[3]; s.y[2] = s.y[3];
+        init_conic(s);
+        emit(static_cast<const Segment &>(s));
+        return;
+    }
+    if (init_cubic(s)) {
+        emit(static_cast<const Segment &>(s));
+    } else if (depth > 0) {
+        // numerically troublesome piece: split in half and retry
+        double l[4][2], r[4][2];
+        for (int c = 0; c < 2; ++c) {
+            double a = .5*(p[0][c]+p[1][c]), b = .5*(p[1][c]+p[2][c]);
+            double d = .5*(p[2][c]+p[3][c]), e = .5*(a+b), f = .5*(b+d);
+            double m = .5*(e+f);
+            l[0][c] = p[0][c]; l[1][c] = a; l[2][c] = e; l[3][c] = m;
+            r[0][c] = m; r[1][c] = f; r[2][c] = d; r[3][c] = p[3][c];
+        }
+        emit_convex_cubic(l, depth-1, emit);
+        emit_convex_cubic(r, depth-1, emit);
+    } else {
+        degrade_to_linear(s);
+        emit(static_cast<const Segment &>(s));
+    }
+}
+
+} // namespace detail
+
+template <typename EMIT>
+void emit_cubic_segment(float x0, float y0, float x1, float y1,
+    float x2, float y2, float x3, float y3, EMIT &&emit) {
+    double p[4][2] = {{x0, y0}, {x1, y1}, {x2, y2}, {x3, y3}};
+    // derivative is 3*(a + 2*b*t + c*t^2)
+    double a[2], b[2], c[2];
+    for (int k = 0; k < 2; ++k) {
+        a[k] = p[1][k]-p[0][k];
+        b[k] = p[2][k]-2.*p[1][k]+p[0][k];
+        c[k] = p[3][k]-3.*p[2][k]+3.*p[1][k]-p[0][k];
+    }
+    double t[6];
+    int n = detail::roots01(c[0], 2.*b[0], a[0], t);
+    n += detail::roots01(c[1], 2.*b[1], a[1], t+n);
+    // inflections
+    n += detail::roots01(detail::cross(b[0], b[1], c[0], c[1]),
+        detail::cross(a[0], a[1], c[0], c[1]),
+        detail::cross(a[0], a[1], b[0], b[1]), t+n);
+    n = detail::unique01(t, n);
+    double t0 = 0.;
+    for (int i = 0; i <= n; ++i) {
+        double q[4][2];
+        if (i < n) {
+            double u = (t[i]-t0)/(1.-t0);
+            for (int k = 0; k < 2; ++k) {
+                double ab = p[0][k]+u*(p[1][k]-p[0][k]);
+                double bc = p[1][k]+u*(p[2][k]-p[1][k]);
+                double cd = p[2][k]+u*(p[3][k]-p[2][k]);
+                double abc = ab+u*(bc-ab), bcd = bc+u*(cd-bc);
+                double m = abc+u*(bcd-abc);
+                q[0][k] = p[0][k]; q[1][k] = ab; q[2][k] = abc; q[3][k] = m;
+                p[0][k] = m; p[1][k] = bcd; p[2][k] = cd;
+            }
+            t0 = t[i];
+        } else {
+            for (int j = 0; j < 4; ++j) {
+                q[j][0] = p[j][0];
+                q[j][1] = p[j][1];
+            }
+        }
+        detail::emit_convex_cubic(q, 8, emit);
+    }
+}
+
+} } } // namespace rvg::driver::png
+
+#endif
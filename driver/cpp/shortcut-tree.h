@@ -0,0 +1,556 @@
+#ifndef RVG_DRIVER_PNG_SHORTCUT_TREE_H
+#define RVG_DRIVER_PNG_SHORTCUT_TREE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "driver/cpp/segment.h"
+#include "driver/cpp/array.h"
+#include "driver/cpp/thread-pool.h"
+
+namespace rvg {
+    namespace driver {
+        namespace png {
+
+// A shortcut segment stands for a piece of path that lies entirely to
+// the right of a cell. Rays cast from any sample in the cell cross it
+// exactly when the sample height is within [ylo, yhi).
+struct Shortcut {
+    float ylo, yhi;
+    int32_t dir;
+};
+
+// What a leaf cell knows about one element: the winding number
+// increment every sample in the cell starts from, and the contiguous
+// ranges of monotonic segments and shortcuts it still has to test.
+struct CellElement {
+    uint32_t element;
+    int32_t winding;
+    uint32_t first_segment, n_segments;
+    uint32_t first_shortcut, n_shortcuts;
+};
+
+// A node of the quadtree. Children are stored contiguously, in the
+// order bottom-left, bottom-right, top-left, top-right. Only leaves
+// have elements.
+struct Cell {
+    float xmin, ymin, xmax, ymax;
+    int32_t children;
+    uint32_t first_element, n_elements;
+    uint16_t depth;
+};
+
+// Subdivision parameters. A cell is split while its estimated sampling
+// cost, the number of samples falling in it times the weighted number of
+// segments each of them has to be tested against, exceeds max_cost.
+// Cells with at most max_segments segments, or at max_depth, are leaves.
+struct TreeParams {
+    int max_depth = 10;
+    int max_segments = 4;
+    float max_cost = 1024.f;
+    float samples_per_pixel = 1.f;
+    // relative cost of testing a sample against each Segment::Type
+    float weights[4] = {1.f, 2.f, 3.f, 4.f};
+    // threads used to build the tree (does not change its shape)
+    int threads = 1;
+};
+
+// Shortcut tree, after "Massively Parallel Vector Graphics" (Ganacim et
+// al., 2014). Each leaf holds, for each element that may cover it, the
+// segments that intersect it, the shortcuts standing for segments to its
+// right, and the winding number increment due to everything else.
+class ShortcutTree {
+public:
+
+    // Builds the tree over [xmin,xmax)x[ymin,ymax). Segments of element
+    // e are segments[offsets[e]] to segments[offsets[e+1]-1]. The
+    // predicate inside(e, w) tells if element e covers a sample with
+    // winding number w, and is used to drop elements that cannot
+    // contribute to a cell. The predicate opaque(e) tells if element e
+    // hides everything beneath it, so that cells it covers entirely can
+    // drop the elements below.
+    template <typename INSIDE, typename OPAQUE>
+    void build(const std::vector<Segment> &segments,
+        const std::vector<uint32_t> &offsets,
+        float xmin, float ymin, float xmax, float ymax,
+        const TreeParams &params, INSIDE &&inside, OPAQUE &&opaque);
+
+    // Adopts arrays produced by an earlier build, e.g. from a cache file
+    void assign(Array<Cell> &&cells, Array<CellElement> &&elements,
+        Array<Segment> &&segments, Array<Shortcut> &&shortcuts) {
+        m_cells = std::move(cells);
+        m_elements = std::move(elements);
+        m_segments = std::move(segments);
+        m_shortcuts = std::move(shortcuts);
+        index_leaves();
+    }
+
+    // Returns the leaf containing the sample. The grid usually gives the
+    // leaf right away. Otherwise, the search descends from the cell it
+    // gives, or from the root if the sample is not in that cell.
+    const Cell &locate(float x, float y) const {
+        const Cell *c = &m_cells[0];
+        if (!m_grid.empty()) {
+            float fx = (x - c->xmin)*m_scale_x, fy = (y - c->ymin)*m_scale_y;
+            float last = static_cast<float>((1 << m_grid_level) - 1);
+            fx = std::min(std::max(fx, 0.f), last);
+            fy = std::min(std::max(fy, 0.f), last);
+            const Cell *g = &m_cells[m_grid[morton(static_cast<uint32_t>(fx),
+                static_cast<uint32_t>(fy))]];
+            if (x >= g->xmin && x < g->xmax && y >= g->ymin && y < g->ymax) {
+                c = g;
+            }
+        }
+        while (c->children >= 0) {
+            float mx = .5f*(c->xmin + c->xmax);
+            float my = .5f*(c->ymin + c->ymax);
+            c = &m_cells[c->children + (x >= mx) + 2*(y >= my)];
+        }
+        return *c;
+    }
+
+    // Returns true if the sample is inside the root cell
+    bool contains(float x, float y) const {
+        const Cell &r = m_cells[0];
+        return x >= r.xmin && x < r.xmax && y >= r.ymin && y < r.ymax;
+    }
+
+    // Returns true if pred(leaf) holds for every leaf that overlaps the
+    // box [xmin,xmax]x[ymin,ymax]
+    template <typename PRED>
+    bool all_leaves(float xmin, float ymin, float xmax, float ymax,
+        PRED &&pred) const {
+        return all_leaves(m_cells[0], xmin, ymin, xmax, ymax, pred);
+    }
+
+    const Array<Cell> &cells(void) const { return m_cells; }
+    const Array<CellElement> &elements(void) const { return m_elements; }
+    const Array<Segment> &segments(void) const { return m_segments; }
+    const Array<Shortcut> &shortcuts(void) const { return m_shortcuts; }
+
+    // Winding number of element entry ce at the sample
+    int winding(const CellElement &ce, float x, float y) const {
+        int w = ce.winding;
+        const Shortcut *sc = &m_shortcuts[ce.first_shortcut];
+        for (uint32_t i = 0; i < ce.n_shortcuts; ++i) {
+            if (sc[i].ylo <= y && y < sc[i].yhi) w += sc[i].dir;
+        }
+        const Segment *s = &m_segments[ce.first_segment];
+        for (uint32_t i = 0; i < ce.n_segments; ++i) {
+            if (s[i].crosses(x, y)) w += s[i].dir;
+        }
+        return w;
+    }
+
+private:
+
+    // Temporary contents of a cell during construction. Segments are
+    // referred to by their index into the input array.
+    struct Content {
+        std::vector<CellElement> elements;
+        std::vector<uint32_t> segments;
+        std::vector<Shortcut> shortcuts;
+    };
+
+    // Arrays being filled during construction
+    struct Storage {
+        std::vector<Cell> cells;
+        std::vector<CellElement> elements;
+        std::vector<Segment> segments;
+        std::vector<Shortcut> shortcuts;
+    };
+
+    // Cell whose subtree is still to be built
+    struct Pending {
+        uint32_t index;
+        Content content;
+    };
+
+    // Where a subtree built on its own goes in the final arrays
+    struct Bases {
+        size_t cells, elements, segments, shortcuts;
+    };
+
+    template <typename INSIDE, typename OPAQUE>
+    static void classify(const std::vector<Segment> &segments,
+        const Content &parent, const Cell &cell, Content &child,
+        INSIDE &&inside, OPAQUE &&opaque);
+
+    template <typename INSIDE, typename OPAQUE>
+    static void subdivide(const std::vector<Segment> &segments,
+        uint32_t index, const Content &content, const TreeParams &params,
+        INSIDE &&inside, OPAQUE &&opaque, Storage &storage);
+
+    static bool is_leaf(const std::vector<Segment> &segments,
+        const Cell &cell, const Content &content, const TreeParams &params);
+
+    static void store_leaf(const std::vector<Segment> &segments,
+        uint32_t index, const Content &content, Storage &storage);
+
+    template <typename PRED>
+    bool all_leaves(const Cell &c, float xmin, float ymin, float xmax,
+        float ymax, PRED &pred) const {
+        if (c.xmin > xmax || c.xmax <= xmin || c.ymin > ymax ||
+            c.ymax <= ymin) {
+            return true;
+        }
+        if (c.children < 0) return pred(c);
+        for (int k = 0; k < 4; ++k) {
+            if (!all_leaves(m_cells[c.children+k], xmin, ymin, xmax, ymax,
+                pred)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    template <typename INSIDE, typename OPAQUE>
+    static std::vector<Pending> expand(const std::vector<Segment> &segments,
+        std::vector<Pending> &&frontier, const TreeParams &params,
+        INSIDE &&inside, OPAQUE &&opaque, Storage &storage);
+
+    static void merge(uint32_t index, const Bases &bases, Storage &&subtree,
+        Storage &storage);
+
+    // Interleaves the bits of x and y, so that nearby grid entries are
+    // nearby in memory
+    static uint32_t morton(uint32_t x, uint32_t y) {
+        return spread_bits(x) | (spread_bits(y) << 1);
+    }
+
+    static uint32_t spread_bits(uint32_t v) {
+        v &= 0xffff;
+        v = (v | (v << 8)) & 0x00ff00ff;
+        v = (v | (v << 4)) & 0x0f0f0f0f;
+        v = (v | (v << 2)) & 0x33333333;
+        v = (v | (v << 1)) & 0x55555555;
+        return v;
+    }
+
+    void index_leaves(void);
+    void index_cell(int32_t index, int depth, uint32_t gx, uint32_t gy);
+
+    // Deepest level covered by the grid, at 4 bytes per entry
+    static constexpr int max_grid_level = 10;
+
+    Array<Cell> m_cells;
+    Array<CellElement> m_elements;
+    Array<Segment> m_segments;
+    Array<Shortcut> m_shortcuts;
+    // Uniform grid over the root at the depth of the deepest leaf, in
+    // Morton order. Each entry holds the leaf covering it or, where
+    // leaves are deeper than the grid, the cell at the grid level.
+    std::vector<int32_t> m_grid;
+    int m_grid_level = 0;
+    float m_scale_x = 0.f, m_scale_y = 0.f;
+};
+
+template <typename INSIDE, typename OPAQUE>
+void ShortcutTree::build(const std::vector<Segment> &segments,
+    const std::vector<uint32_t> &offsets,
+    float xmin, float ymin, float xmax, float ymax,
+    const TreeParams &params, INSIDE &&inside, OPAQUE &&opaque) {
+    Storage storage;
+    // virtual parent of the root, holding every segment
+    Content all;
+    for (uint32_t e = 0; e+1 < offsets.size(); ++e) {
+        CellElement ce{e, 0, static_cast<uint32_t>(all.segments.size()),
+            offsets[e+1]-offsets[e], 0, 0};
+        for (uint32_t i = offsets[e]; i < offsets[e+1]; ++i) {
+            all.segments.push_back(i);
+        }
+        all.elements.push_back(ce);
+    }
+    storage.cells.push_back(Cell{xmin, ymin, xmax, ymax, -1, 0, 0, 0});
+    std::vector<Pending> frontier(1);
+    frontier[0].index = 0;
+    classify(segments, all, storage.cells[0], frontier[0].content, inside,
+        opaque);
+    int threads = std::max(1, params.threads);
+    if (threads <= 1) {
+        subdivide(segments, 0, frontier[0].content, params, inside, opaque,
+            storage);
+    } else {
+        // split the top levels breadth first until there are enough
+        // subtrees to keep every thread busy, then build each subtree
+        // into its own storage, and append them all at the end
+        size_t target = 8*static_cast<size_t>(threads);
+        while (!frontier.empty() && frontier.size() < target) {
+            frontier = expand(segments, std::move(frontier), params, inside,
+                opaque, storage);
+        }
+        std::vector<Storage> subtrees(frontier.size());
+        parallel_for(static_cast<int>(frontier.size()), threads,
+            [&](int i) {
+                Storage &sub = subtrees[i];
+                sub.cells.push_back(storage.cells[frontier[i].index]);
+                subdivide(segments, 0, frontier[i].content, params, inside,
+                    opaque, sub);
+            });
+        // find where each subtree goes, then copy them all in parallel
+        std::vector<Bases> bases(subtrees.size());
+        Bases end{storage.cells.size(), storage.elements.size(),
+            storage.segments.size(), storage.shortcuts.size()};
+        for (size_t i = 0; i < subtrees.size(); ++i) {
+            bases[i] = end;
+            end.cells += subtrees[i].cells.size()-1;
+            end.elements += subtrees[i].elements.size();
+            end.segments += subtrees[i].segments.size();
+            end.shortcuts += subtrees[i].shortcuts.size();
+        }
+        storage.cells.resize(end.cells);
+        storage.elements.resize(end.elements);
+        storage.segments.resize(end.segments);
+        storage.shortcuts.resize(end.shortcuts);
+        parallel_for(static_cast<int>(subtrees.size()), threads,
+            [&](int i) {
+                merge(frontier[i].index, bases[i], std::move(subtrees[i]),
+                    storage);
+            });
+    }
+    assign(Array<Cell>(std::move(storage.cells)),
+        Array<CellElement>(std::move(storage.elements)),
+        Array<Segment>(std::move(storage.segments)),
+        Array<Shortcut>(std::move(storage.shortcuts)));
+}
+
+template <typename INSIDE, typename OPAQUE>
+void ShortcutTree::classify(const std::vector<Segment> &segments,
+    const Content &parent, const Cell &cell, Content &child,
+    INSIDE &&inside, OPAQUE &&opaque) {
+    // tolerance used to push borderline segments into the cell itself,
+    // where they are tested exactly
+    const float eps = 1e-3f;
+    for (const CellElement &pe: parent.elements) {
+        CellElement ce{pe.element, pe.winding,
+            static_cast<uint32_t>(child.segments.size()), 0,
+            static_cast<uint32_t>(child.shortcuts.size()), 0};
+        auto add_shortcut = [&](float lo, float hi, int dir) {
+            if (lo <= cell.ymin && hi >= cell.ymax) {
+                ce.winding += dir;
+            } else {
+                child.shortcuts.push_back(Shortcut{lo, hi, dir});
+                ++ce.n_shortcuts;
+            }
+        };
+        for (uint32_t i = 0; i < pe.n_segments; ++i) {
+            uint32_t id = parent.segments[pe.first_segment+i];
+            const Segment &s = segments[id];
+            float lo = std::max(s.ymin, cell.ymin);
+            float hi = std::min(s.ymax, cell.ymax);
+            if (lo >= hi) continue;
+            float sxmin = s.xmin, sxmax = s.xmax;
+            if (sxmin <= cell.xmax + eps && sxmax >= cell.xmin - eps) {
+                // restrict horizontal extent to the strip of the cell
+                float xa = s.x_at(lo), xb = s.x_at(hi);
+                sxmin = std::min(xa, xb);
+                sxmax = std::max(xa, xb);
+            }
+            if (sxmin > cell.xmax + eps) {
+                add_shortcut(lo, hi, s.dir);
+            } else if (sxmax >= cell.xmin - eps) {
+                child.segments.push_back(id);
+                ++ce.n_segments;
+            }
+        }
+        // parent shortcuts are to the right of the child as well
+        for (uint32_t i = 0; i < pe.n_shortcuts; ++i) {
+            const Shortcut &sc = parent.shortcuts[pe.first_shortcut+i];
+            float lo = std::max(sc.ylo, cell.ymin);
+            float hi = std::min(sc.yhi, cell.ymax);
+            if (lo < hi) add_shortcut(lo, hi, sc.dir);
+        }
+        if (ce.n_segments == 0 && ce.n_shortcuts == 0) {
+            if (!inside(ce.element, ce.winding)) continue;
+            // elements come bottom to top, so whatever is already in
+            // the cell is hidden by an opaque element covering it all
+            if (opaque(ce.element)) {
+                child.elements.clear();
+                child.segments.clear();
+                child.shortcuts.clear();
+                ce.first_segment = ce.first_shortcut = 0;
+            }
+        }
+        child.elements.push_back(ce);
+    }
+}
+
+template <typename INSIDE, typename OPAQUE>
+void ShortcutTree::subdivide(const std::vector<Segment> &segments,
+    uint32_t index, const Content &content, const TreeParams &params,
+    INSIDE &&inside, OPAQUE &&opaque, Storage &storage) {
+    std::vector<Cell> &cells = storage.cells;
+    const Cell cell = cells[index];
+    if (is_leaf(segments, cell, content, params)) {
+        store_leaf(segments, index, content, storage);
+        return;
+    }
+    int32_t first = static_cast<int32_t>(cells.size());
+    cells[index].children = first;
+    float mx = .5f*(cell.xmin + cell.xmax);
+    float my = .5f*(cell.ymin + cell.ymax);
+    uint16_t depth = static_cast<uint16_t>(cell.depth+1);
+    cells.push_back(Cell{cell.xmin, cell.ymin, mx, my, -1, 0, 0, depth});
+    cells.push_back(Cell{mx, cell.ymin, cell.xmax, my, -1, 0, 0, depth});
+    cells.push_back(Cell{cell.xmin, my, mx, cell.ymax, -1, 0, 0, depth});
+    cells.push_back(Cell{mx, my, cell.xmax, cell.ymax, -1, 0, 0, depth});
+    for (int k = 0; k < 4; ++k) {
+        Content child;
+        classify(segments, content, cells[first+k], child, inside, opaque);
+        subdivide(segments, first+k, child, params, inside, opaque,
+            storage);
+    }
+}
+
+// Stores or splits each pending cell, and returns the children that are
+// still to be built. Children are classified in parallel, each into its
+// own content.
+template <typename INSIDE, typename OPAQUE>
+std::vector<ShortcutTree::Pending> ShortcutTree::expand(
+    const std::vector<Segment> &segments, std::vector<Pending> &&frontier,
+    const TreeParams &params, INSIDE &&inside, OPAQUE &&opaque,
+    Storage &storage) {
+    std::vector<Pending> next;
+    for (const Pending &p: frontier) {
+        const Cell cell = storage.cells[p.index];
+        if (is_leaf(segments, cell, p.content, params)) {
+            store_leaf(segments, p.index, p.content, storage);
+            continue;
+        }
+        int32_t first = static_cast<int32_t>(storage.cells.size());
+        storage.cells[p.index].children = first;
+        float mx = .5f*(cell.xmin + cell.xmax);
+        float my = .5f*(cell.ymin + cell.ymax);
+        uint16_t depth = static_cast<uint16_t>(cell.depth+1);
+        storage.cells.push_back(
+            Cell{cell.xmin, cell.ymin, mx, my, -1, 0, 0, depth});
+        storage.cells.push_back(
+            Cell{mx, cell.ymin, cell.xmax, my, -1, 0, 0, depth});
+        storage.cells.push_back(
+            Cell{cell.xmin, my, mx, cell.ymax, -1, 0, 0, depth});
+        storage.cells.push_back(
+            Cell{mx, my, cell.xmax, cell.ymax, -1, 0, 0, depth});
+        for (int k = 0; k < 4; ++k) {
+            next.push_back(Pending{static_cast<uint32_t>(first+k), Content()});
+        }
+    }
+    // parents are found through the child index of their cell
+    std::vector<const Content *> parents(storage.cells.size(), nullptr);
+    for (const Pending &p: frontier) {
+        if (storage.cells[p.index].children >= 0) {
+            for (int k = 0; k < 4; ++k) {
+                parents[storage.cells[p.index].children+k] = &p.content;
+            }
+        }
+    }
+    parallel_for(static_cast<int>(next.size()), params.threads, [&](int i) {
+        classify(segments, *parents[next[i].index],
+            storage.cells[next[i].index], next[i].content, inside, opaque);
+    });
+    return next;
+}
+
+// Copies a subtree built on its own into the space reserved for it at
+// bases. Its root stands for cell index. Subtrees write to disjoint
+// ranges, so they can be merged in parallel.
+inline void ShortcutTree::merge(uint32_t index, const Bases &bases,
+    Storage &&subtree, Storage &storage) {
+    // cell i > 0 of the subtree goes to bases.cells+i-1
+    int32_t cell_base = static_cast<int32_t>(bases.cells) - 1;
+    uint32_t element_base = static_cast<uint32_t>(bases.elements);
+    uint32_t segment_base = static_cast<uint32_t>(bases.segments);
+    uint32_t shortcut_base = static_cast<uint32_t>(bases.shortcuts);
+    for (size_t i = 0; i < subtree.cells.size(); ++i) {
+        Cell c = subtree.cells[i];
+        if (c.children >= 0) c.children += cell_base;
+        else c.first_element += element_base;
+        storage.cells[i == 0? index: cell_base+i] = c;
+    }
+    CellElement *elements = storage.elements.data() + bases.elements;
+    for (CellElement ce: subtree.elements) {
+        ce.first_segment += segment_base;
+        ce.first_shortcut += shortcut_base;
+        *elements++ = ce;
+    }
+    std::copy(subtree.segments.begin(), subtree.segments.end(),
+        storage.segments.begin() + bases.segments);
+    std::copy(subtree.shortcuts.begin(), subtree.shortcuts.end(),
+        storage.shortcuts.begin() + bases.shortcuts);
+    subtree = Storage();
+}
+
+inline void ShortcutTree::index_leaves(void) {
+    m_grid.clear();
+    if (m_cells.empty()) return;
+    const Cell &root = m_cells[0];
+    if (!(root.xmax > root.xmin) || !(root.ymax > root.ymin)) return;
+    int depth = 0;
+    for (const Cell &c: m_cells) {
+        if (c.children < 0) depth = std::max(depth, static_cast<int>(c.depth));
+    }
+    m_grid_level = std::min(depth, max_grid_level);
+    uint32_t n = 1u << m_grid_level;
+    m_scale_x = static_cast<float>(n)/(root.xmax - root.xmin);
+    m_scale_y = static_cast<float>(n)/(root.ymax - root.ymin);
+    m_grid.assign(static_cast<size_t>(n)*n, 0);
+    index_cell(0, 0, 0, 0);
+}
+
+inline void ShortcutTree::index_cell(int32_t index, int depth, uint32_t gx,
+    uint32_t gy) {
+    const Cell &c = m_cells[index];
+    if (c.children < 0 || depth == m_grid_level) {
+        uint32_t size = 1u << (m_grid_level - depth);
+        for (uint32_t y = 0; y < size; ++y) {
+            for (uint32_t x = 0; x < size; ++x) {
+                m_grid[morton(gx*size+x, gy*size+y)] = index;
+            }
+        }
+        return;
+    }
+    for (int k = 0; k < 4; ++k) {
+        index_cell(c.children+k, depth+1, 2*gx + (k & 1), 2*gy + (k >> 1));
+    }
+}
+
+inline bool ShortcutTree::is_leaf(const std::vector<Segment> &segments,
+    const Cell &cell, const Content &content, const TreeParams &params) {
+    if (static_cast<int>(content.segments.size()) <= params.max_segments ||
+        cell.depth >= params.max_depth) {
+        return true;
+    }
+    float weight = 0.f;
+    for (uint32_t id: content.segments) {
+        weight += params.weights[static_cast<int>(segments[id].type)];
+    }
+    float area = (cell.xmax - cell.xmin)*(cell.ymax - cell.ymin);
+    return area*params.samples_per_pixel*weight <= params.max_cost;
+}
+
+inline void ShortcutTree::store_leaf(const std::vector<Segment> &segments,
+    uint32_t index, const Content &content, Storage &storage) {
+    Cell &cell = storage.cells[index];
+    cell.first_element = static_cast<uint32_t>(storage.elements.size());
+    cell.n_elements = static_cast<uint32_t>(content.elements.size());
+    for (CellElement ce: content.elements) {
+        uint32_t first_segment =
+            static_cast<uint32_t>(storage.segments.size());
+        for (uint32_t i = 0; i < ce.n_segments; ++i) {
+            storage.segments.push_back(
+                segments[content.segments[ce.first_segment+i]]);
+        }
+        uint32_t first_shortcut =
+            static_cast<uint32_t>(storage.shortcuts.size());
+        storage.shortcuts.insert(storage.shortcuts.end(),
+            content.shortcuts.begin()+ce.first_shortcut,
+            content.shortcuts.begin()+ce.first_shortcut+ce.n_shortcuts);
+        ce.first_segment = first_segment;
+        ce.first_shortcut = first_shortcut;
+        storage.elements.push_back(ce);
+    }
+}
+
+} } } // namespace rvg::driver::png
+
+#endif
@@ -0,0 +1,258 @@
+#ifndef RVG_DRIVER_PNG_STATS_H
+#define RVG_DRIVER_PNG_STATS_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "driver/cpp/shortcut-tree.h"
+
+namespace rvg {
+    namespace driver {
+        namespace png {
+
+// Kinds of paint, in the order paint evaluations are counted
+enum class PaintKind { solid, linear, radial, texture, count };
+
+// Work done while rendering. Each thread counts into its own.
+struct Counters {
+    uint64_t samples = 0;       // samples composited
+    uint64_t filled = 0;        // pixels filled from leaves of constant color
+    uint64_t cells = 0;         // leaves visited, once per sample or packet
+    uint64_t elements = 0;      // winding numbers computed
+    uint64_t segments[4] = {0, 0, 0, 0}; // segment tests, by Segment::Type
+    uint64_t shortcuts = 0;     // shortcut tests
+    uint64_t paints[static_cast<int>(PaintKind::count)] = {0, 0, 0, 0};
+    uint64_t early_exits = 0;   // samples opaque before their last element
+
+    void add(const Counters &o) {
+        samples += o.samples;
+        filled += o.filled;
+        cells += o.cells;
+        elements += o.elements;
+        for (int t = 0; t < 4; ++t) segments[t] += o.segments[t];
+        shortcuts += o.shortcuts;
+        for (int p = 0; p < static_cast<int>(PaintKind::count); ++p) {
+            paints[p] += o.paints[p];
+        }
+        early_exits += o.early_exits;
+    }
+};
+
+// Counts the tests needed for the winding number of ce at n samples, and
+// returns how many there were
+inline uint64_t count_winding(Counters &c, const ShortcutTree &tree,
+    const CellElement &ce, uint64_t n) {
+    c.elements += n;
+    c.shortcuts += n*ce.n_shortcuts;
+    const Segment *s = &tree.segments()[ce.first_segment];
+    for (uint32_t i = 0; i < ce.n_segments; ++i) {
+        c.segments[static_cast<int>(s[i].type)] += n;
+    }
+    return n*(ce.n_segments + ce.n_shortcuts);
+}
+
+namespace detail {
+
+// Bucket 0 holds zeros, bucket k values in [2^(k-1), 2^k)
+inline void log2_histogram(std::vector<uint64_t> &h, uint64_t v) {
+    size_t k = 0;
+    while (v) {
+        v >>= 1;
+        ++k;
+    }
+    if (h.size() <= k) h.resize(k+1, 0);
+    ++h[k];
+}
+
+inline void write_array(FILE *f, const std::vector<uint64_t> &v) {
+    fputc('[', f);
+    for (size_t i = 0; i < v.size(); ++i) {
+        fprintf(f, "%s%llu", i? ", ": "",
+            static_cast<unsigned long long>(v[i]));
+    }
+    fputc(']', f);
+}
+
+inline void write_counters(FILE *f, const Counters &c, const char *indent) {
+    auto u = [](uint64_t v) { return static_cast<unsigned long long>(v); };
+    fprintf(f, "{\n");
+    fprintf(f, "%s  \"samples\": %llu,\n", indent, u(c.samples));
+    fprintf(f, "%s  \"filled\": %llu,\n", indent, u(c.filled));
+    fprintf(f, "%s  \"cells\": %llu,\n", indent, u(c.cells));
+    fprintf(f, "%s  \"elements\": %llu,\n", indent, u(c.elements));
+    fprintf(f, "%s  \"segments\": {\"linear\": %llu, \"quadratic\": %llu, "
+        "\"rational_quadratic\": %llu, \"cubic\": %llu},\n", indent,
+        u(c.segments[0]), u(c.segments[1]), u(c.segments[2]),
+        u(c.segments[3]));
+    fprintf(f, "%s  \"shortcuts\": %llu,\n", indent, u(c.shortcuts));
+    fprintf(f, "%s  \"paints\": {\"solid\": %llu, \"linear\": %llu, "
+        "\"radial\": %llu, \"texture\": %llu},\n", indent,
+        u(c.paints[0]), u(c.paints[1]), u(c.paints[2]), u(c.paints[3]));
+    fprintf(f, "%s  \"early_exits\": %llu\n", indent, u(c.early_exits));
+    fprintf(f, "%s}", indent);
+}
+
+} // namespace detail
+
+// Statistics of a render call, written as JSON with -stats:<file>.
+// Counters are kept per frame, and per leaf of the tree the accel was
+// built with. Leaves of the trees out-of-core renders build for each
+// band are not counted individually.
+class RenderStats {
+    struct Frame {
+        float tx, ty;
+        double culling, rendering, saving;
+        Counters counters;
+    };
+
+    const ShortcutTree &m_tree;
+    std::mutex m_mutex;
+    std::vector<std::unique_ptr<Counters>> m_threads;
+    uint64_t m_id;
+    std::unique_ptr<std::atomic<uint64_t>[]> m_cell_samples, m_cell_tests;
+    std::vector<Frame> m_frames;
+
+    static uint64_t next_id(void) {
+        static std::atomic<uint64_t> id(0);
+        return ++id;
+    }
+
+public:
+    explicit RenderStats(const ShortcutTree &tree):
+        m_tree(tree),
+        m_id(next_id()),
+        m_cell_samples(new std::atomic<uint64_t>[tree.cells().size()]()),
+        m_cell_tests(new std::atomic<uint64_t>[tree.cells().size()]())
+        { ; }
+
+    RenderStats(const RenderStats &) = delete;
+    RenderStats &operator=(const RenderStats &) = delete;
+
+    // Counters of the calling thread for the current frame
+    Counters &local(void) {
+        thread_local uint64_t id = 0;
+        thread_local Counters *counters = nullptr;
+        if (id != m_id) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_threads.emplace_back(new Counters());
+            counters = m_threads.back().get();
+            id = m_id;
+        }
+        return *counters;
+    }
+
+    // Samples taken in cell c, and the tests they needed
+    void count_cell(const Cell &c, uint64_t samples, uint64_t tests) {
+        const Cell *base = m_tree.cells().data();
+        if (&c < base || &c >= base + m_tree.cells().size()) return;
+        m_cell_samples[&c - base].fetch_add(samples,
+            std::memory_order_relaxed);
+        m_cell_tests[&c - base].fetch_add(tests, std::memory_order_relaxed);
+    }
+
+    // Gathers the counters of every thread into a new frame. Threads
+    // count into fresh counters from then on.
+    void end_frame(float tx, float ty, double culling, double rendering,
+        double saving) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Frame frame{tx, ty, culling, rendering, saving, Counters()};
+        for (const auto &c: m_threads) frame.counters.add(*c);
+        m_frames.push_back(frame);
+        m_threads.clear();
+        m_id = next_id();
+    }
+
+    // Writes the report to path, with the n_hot leaves that took the most
+    // tests, or all leaves that took any if n_hot is 0
+    bool write(const std::string &path, size_t n_hot) const {
+        using namespace detail;
+        FILE *f = fopen(path.c_str(), "w");
+        if (!f) return false;
+        const Array<Cell> &cells = m_tree.cells();
+        std::vector<uint64_t> depth, elements, segments, shortcuts;
+        std::vector<uint32_t> hot;
+        uint64_t leaves = 0;
+        for (size_t c = 0; c < cells.size(); ++c) {
+            const Cell &cell = cells[c];
+            if (cell.children >= 0) continue;
+            ++leaves;
+            if (depth.size() <= cell.depth) depth.resize(cell.depth+1, 0);
+            ++depth[cell.depth];
+            log2_histogram(elements, cell.n_elements);
+            uint64_t n_segments = 0, n_shortcuts = 0;
+            const CellElement *ce = &m_tree.elements()[cell.first_element];
+            for (uint32_t i = 0; i < cell.n_elements; ++i) {
+                n_segments += ce[i].n_segments;
+                n_shortcuts += ce[i].n_shortcuts;
+            }
+            log2_histogram(segments, n_segments);
+            log2_histogram(shortcuts, n_shortcuts);
+            if (m_cell_tests[c].load() > 0) {
+                hot.push_back(static_cast<uint32_t>(c));
+            }
+        }
+        // leaves where most of the work went
+        auto busier = [this](uint32_t a, uint32_t b) {
+            return m_cell_tests[a].load() > m_cell_tests[b].load();
+        };
+        if (n_hot > 0 && hot.size() > n_hot) {
+            std::partial_sort(hot.begin(), hot.begin()+n_hot, hot.end(),
+                busier);
+            hot.resize(n_hot);
+        } else {
+            std::sort(hot.begin(), hot.end(), busier);
+        }
+        fprintf(f, "{\n  \"tree\": {\n");
+        fprintf(f, "    \"cells\": %llu,\n",
+            static_cast<unsigned long long>(cells.size()));
+        fprintf(f, "    \"leaves\": %llu,\n",
+            static_cast<unsigned long long>(leaves));
+        fprintf(f, "    \"depth\": ");
+        write_array(f, depth);
+        fprintf(f, ",\n    \"elements_per_leaf\": ");
+        write_array(f, elements);
+        fprintf(f, ",\n    \"segments_per_leaf\": ");
+        write_array(f, segments);
+        fprintf(f, ",\n    \"shortcuts_per_leaf\": ");
+        write_array(f, shortcuts);
+        fprintf(f, "\n  },\n  \"frames\": [");
+        Counters total;
+        for (size_t i = 0; i < m_frames.size(); ++i) {
+            const Frame &fr = m_frames[i];
+            fprintf(f, "%s\n    {\n", i? ",": "");
+            fprintf(f, "      \"tx\": %g, \"ty\": %g,\n", fr.tx, fr.ty);
+            fprintf(f, "      \"seconds\": {\"culling\": %.6f, "
+                "\"rendering\": %.6f, \"saving\": %.6f},\n",
+                fr.culling, fr.rendering, fr.saving);
+            fprintf(f, "      \"counters\": ");
+            write_counters(f, fr.counters, "      ");
+            fprintf(f, "\n    }");
+            total.add(fr.counters);
+        }
+        fprintf(f, "\n  ],\n  \"total\": ");
+        write_counters(f, total, "  ");
+        fprintf(f, ",\n  \"hot_cells\": [");
+        for (size_t i = 0; i < hot.size(); ++i) {
+            const Cell &cell = cells[hot[i]];
+            fprintf(f, "%s\n    {\"cell\": %u, \"depth\": %u, "
+                "\"box\": [%g, %g, %g, %g], \"elements\": %u, "
+                "\"samples\": %llu, \"tests\": %llu}", i? ",": "", hot[i],
+                static_cast<unsigned>(cell.depth), cell.xmin, cell.ymin,
+                cell.xmax, cell.ymax, cell.n_elements,
+                static_cast<unsigned long long>(m_cell_samples[hot[i]]),
+                static_cast<unsigned long long>(m_cell_tests[hot[i]]));
+        }
+        fprintf(f, "\n  ]\n}\n");
+        return fclose(f) == 0;
+    }
+};
+
+} } } // namespace rvg::driver::png
+
+#endif
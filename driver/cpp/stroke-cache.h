@@ -0,0 +1,172 @@
+#ifndef RVG_DRIVER_PNG_STROKE_CACHE_H
+#define RVG_DRIVER_PNG_STROKE_CACHE_H
+
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include "shape/shape.h"
+#include "stroke/style.h"
+#include "xform/xform.h"
+
+#include "driver/cpp/cache.h"
+#include "driver/cpp/segment.h"
+
+namespace rvg {
+    namespace driver {
+        namespace png {
+
+// Records everything a Hasher would be fed, so that keys built from it
+// compare exactly, instead of by hash
+class KeyBytes {
+    std::vector<unsigned char> m_bytes;
+public:
+    void add(const void *data, size_t size) {
+        const unsigned char *p = static_cast<const unsigned char *>(data);
+        m_bytes.insert(m_bytes.end(), p, p + size);
+    }
+
+    template <typename T>
+    void add(const T &value) {
+        static_assert(std::is_arithmetic<T>::value || std::is_enum<T>::value,
+            "add fields one by one, never padding");
+        add(&value, sizeof(T));
+    }
+
+    const std::vector<unsigned char> &bytes(void) const { return m_bytes; }
+};
+
+// Identifies the outline of a stroked shape up to a translation: the
+// stroke, style and stroked shape included, and the linear part of the
+// transformation to screen space. Strokes repeated across the scene, or
+// moved from one frame to the next, share the same key.
+struct StrokeKey {
+    std::vector<unsigned char> content;
+    float linear[4];
+
+    bool operator==(const StrokeKey &other) const {
+        return std::memcmp(linear, other.linear, sizeof(linear)) == 0 &&
+            content == other.content;
+    }
+};
+
+struct StrokeKeyHash {
+    size_t operator()(const StrokeKey &k) const {
+        Hasher h;
+        h.add(k.content.data(), k.content.size());
+        for (float f: k.linear) h.add(f);
+        return static_cast<size_t>(h.value());
+    }
+};
+
+// Key for a stroked shape painted with transformation xf
+inline StrokeKey stroke_key(const shape::Shape &shape,
+    const xform::Xform &xf) {
+    KeyBytes bytes;
+    hash_shape(bytes, shape);
+    StrokeKey k;
+    k.content = bytes.bytes();
+    k.linear[0] = xf[0][0]; k.linear[1] = xf[0][1];
+    k.linear[2] = xf[1][0]; k.linear[3] = xf[1][1];
+    return k;
+}
+
+// Outlines of stroked shapes, already broken into monotonic segments in
+// screen space, with the translation each was outlined at. A hit under
+// another translation moves the segments by the difference. Entries used
+// least recently are dropped once the segments take more than the
+// budget.
+class StrokeCache {
+    struct Entry {
+        const StrokeKey *key;   // owned by m_index
+        float tx, ty;
+        std::vector<Segment> segments;
+    };
+    using List = std::list<Entry>;
+
+    std::mutex m_mutex;
+    List m_lru;     // most recently used first
+    std::unordered_map<StrokeKey, List::iterator, StrokeKeyHash> m_index;
+    size_t m_bytes, m_budget;
+    uint64_t m_hits, m_misses;
+
+    void trim(void) {
+        while (m_bytes > m_budget && !m_lru.empty()) {
+            m_bytes -= m_lru.back().segments.size()*sizeof(Segment);
+            m_index.erase(*m_lru.back().key);
+            m_lru.pop_back();
+        }
+    }
+
+public:
+    explicit StrokeCache(size_t budget):
+        m_bytes(0),
+        m_budget(budget),
+        m_hits(0),
+        m_misses(0)
+        { ; }
+
+    StrokeCache(const StrokeCache &) = delete;
+    StrokeCache &operator=(const StrokeCache &) = delete;
+
+    // Appends the outline stored under key, moved to translation tx, ty,
+    // to segments, if there is one
+    bool find(const StrokeKey &key, float tx, float ty,
+        std::vector<Segment> &segments) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto found = m_index.find(key);
+        if (found == m_index.end()) {
+            ++m_misses;
+            return false;
+        }
+        ++m_hits;
+        m_lru.splice(m_lru.begin(), m_lru, found->second);
+        const Entry &e = *found->second;
+        size_t first = segments.size();
+        segments.insert(segments.end(), e.segments.begin(),
+            e.segments.end());
+        float dx = tx - e.tx, dy = ty - e.ty;
+        if (dx != 0.f || dy != 0.f) {
+            for (size_t i = first; i < segments.size(); ++i) {
+                segments[i].translate(dx, dy);
+            }
+        }
+        return true;
+    }
+
+    // Stores the outline of the stroke under key, outlined at
+    // translation tx, ty
+    template <typename IT>
+    void insert(const StrokeKey &key, float tx, float ty,
+        IT first, IT last) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_budget == 0) return;
+        auto inserted = m_index.emplace(key, m_lru.end());
+        if (!inserted.second) return;
+        m_lru.push_front(Entry{&inserted.first->first, tx, ty,
+            std::vector<Segment>(first, last)});
+        inserted.first->second = m_lru.begin();
+        m_bytes += m_lru.front().segments.size()*sizeof(Segment);
+        trim();
+    }
+
+    void set_budget(size_t budget) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_budget = budget;
+        trim();
+    }
+
+    void counts(uint64_t &hits, uint64_t &misses) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        hits = m_hits;
+        misses = m_misses;
+    }
+};
+
+} } } // namespace rvg::driver::png
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef RVG_DRIVER_PNG_SUPERSAMPLING_H
+#define RVG_DRIVER_PNG_SUPERSAMPLING_H
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace rvg {
+    namespace driver {
+        namespace png {
+
+// Reconstruction filters. Each is evaluated at sample offsets u, v in
+// [-1/2,1/2], whatever the radius, so the radius only scales the area
+// the samples are spread over.
+enum class Filter {
+    box,
+    tent,
+    gaussian,   // exp(-(u^2+v^2)/2), as in the Lua driver
+    mitchell    // Mitchell-Netravali, B = C = 1/3, over [-2,2]
+};
+
+inline Filter filter_from_name(const std::string &name) {
+    if (name == "box") return Filter::box;
+    if (name == "tent") return Filter::tent;
+    if (name == "gaussian") return Filter::gaussian;
+    if (name == "mitchell") return Filter::mitchell;
+    throw std::invalid_argument("unknown filter " + name);
+}
+
+namespace detail {
+
+inline float mitchell(float x) {
+    x = std::fabs(x);
+    const float B = 1.f/3.f, C = 1.f/3.f;
+    if (x < 1.f) {
+        return ((12.f-9.f*B-6.f*C)*x*x*x + (-18.f+12.f*B+6.f*C)*x*x +
+            (6.f-2.f*B))/6.f;
+    }
+    if (x < 2.f) {
+        return ((-B-6.f*C)*x*x*x + (6.f*B+30.f*C)*x*x +
+            (-12.f*B-48.f*C)*x + (8.f*B+24.f*C))/6.f;
+    }
+    return 0.f;
+}
+
+} // namespace detail
+
+inline float filter_weight(Filter f, float u, float v) {
+    switch (f) {
+        case Filter::box:
+            return 1.f;
+        case Filter::tent:
+            return std::max(0.f, 1.f-2.f*std::fabs(u))*
+                std::max(0.f, 1.f-2.f*std::fabs(v));
+        case Filter::gaussian:
+            return std::exp(-.5f*(u*u + v*v));
+        case Filter::mitchell:
+            return detail::mitchell(4.f*u)*detail::mitchell(4.f*v);
+        default:
+            return 0.f;
+    }
+}
+
+// Sample positions relative to the pixel center, with their normalized
+// filter weights. Built once per render, shared by every pixel.
+struct SamplingPattern {
+    std::vector<float> dx, dy, w;
+
+    int size(void) const { return static_cast<int>(w.size()); }
+
+    // Half size of the box around each pixel center holding its samples
+    void reach(float &rx, float &ry) const {
+        rx = ry = 0.f;
+        for (size_t s = 0; s < w.size(); ++s) {
+            rx = std::max(rx, std::fabs(dx[s]));
+            ry = std::max(ry, std::fabs(dy[s]));
+        }
+    }
+};
+
+// Builds the pattern from offsets x0, y0, x1, y1... in [-1/2,1/2]^2.
+// No offsets means a single sample at the pixel center.
+inline SamplingPattern make_sampling_pattern(
+    const std::vector<float> &offsets, Filter f, float radius) {
+    SamplingPattern p;
+    if (offsets.size() < 2) {
+        p.dx.push_back(0.f);
+        p.dy.push_back(0.f);
+        p.w.push_back(1.f);
+        return p;
+    }
+    float total = 0.f;
+    for (size_t i = 0; i+1 < offsets.size(); i += 2) {
+        float u = offsets[i], v = offsets[i+1];
+        float w = filter_weight(f, u, v);
+        p.dx.push_back(2.f*radius*u);
+        p.dy.push_back(2.f*radius*v);
+        p.w.push_back(w);
+        total += w;
+    }
+    if (!(total > 0.f)) {
+        throw std::invalid_argument("filter weights add up to zero");
+    }
+    for (float &w: p.w) w /= total;
+    return p;
+}
+
+// Samples are blended in gamma space, like the Lua driver does. Colors
+// are encoded through a table, so that no sample needs a call to pow.
+class GammaTable {
+    static constexpr int size = 1024;
+    float m_encode[size+2];
+public:
+    GammaTable(void) {
+        for (int i = 0; i <= size; ++i) {
+            m_encode[i] = std::pow(static_cast<float>(i)/size, 1.f/2.2f);
+        }
+        m_encode[size+1] = m_encode[size];
+    }
+
+    // c^(1/2.2), interpolated linearly between table entries
+    float encode(float c) const {
+        float t = std::min(std::max(c, 0.f), 1.f)*size;
+        int i = static_cast<int>(t);
+        float f = t - static_cast<float>(i);
+        return m_encode[i] + f*(m_encode[i+1] - m_encode[i]);
+    }
+
+    // Inverse of encode, called once per pixel
+    static float decode(float c) {
+        return std::pow(std::min(std::max(c, 0.f), 1.f), 2.2f);
+    }
+};
+
+} } } // namespace rvg::driver::png
+
+#endif
@@ -1,6 +1,7 @@
 #include <unordered_map>
 #include <string>
 #include <sstream>
+#include <locale>
 
 #include <lua.hpp>
 
@@ -22,6 +23,7 @@
 #include "paint/spread.h"
 
 #include "driver/cpp/svg.h"
+#include "driver/cpp/file-stream.h"
 
 namespace rvg {
     namespace driver {
@@ -30,6 +32,8 @@ namespace rvg {
 using path::Path;
 using xform::Xform;
 using paint::Spread;
+using paint::Paint;
+using shape::Shape;
 using scene::WindingRule;
 
 Accelerated accelerate(const XformableScene &xs, const Viewport &vp) {
@@ -132,33 +136,109 @@ static void print_path_data(const Path &path, std::ostream &out) {
     out << "\"";
 }
 
+// Style of the strokes the driver handles. Fills and other strokes
+// return null.
+static const stroke::Style *driver_stroke_style(const Shape &shape) {
+    if (shape.type() == Shape::Type::stroke &&
+        shape.stroke().style().method() == stroke::Method::driver) {
+        return &shape.stroke().style();
+    }
+    return nullptr;
+}
+
+// Writes the path data of a painted element, as its d attribute. Strokes
+// the driver handles draw the shape being stroked.
+static void print_painted_path_data(const Shape &shape,
+    const Xform &screen_xf, std::ostream &out) {
+    Shape path_shape;
+    Xform pre_xf = xform::Identity();
+    if (driver_stroke_style(shape)) {
+        pre_xf = shape.stroke().shape().xf();
+        // convert shape to be stroked into a path
+        path_shape = shape.stroke().shape().as_path_shape(
+            shape.xf().transformed(screen_xf));
+    } else {
+        path_shape = shape.as_path_shape(screen_xf);
+    }
+    print_path_data(path_shape.path(), pre_xf, out);
+}
+
+// Identifies the definition of a gradient or texture paint by what it
+// contains, so that paints that would be defined alike share one id.
+// Numbers are written as hexadecimal floats, which are exact. Textures
+// are the same if they sample the same image object.
+static std::string paint_key(const Shape &shape, const Paint &paint) {
+    std::ostringstream s;
+    s.imbue(std::locale::classic());
+    s << std::hexfloat;
+    auto print_ramp_key = [&s](const paint::Ramp &ramp) {
+        s << ' ' << static_cast<int>(ramp.spread());
+        for (const auto &stop: ramp.stops()) {
+            const auto &c = stop.color();
+            s << ' ' << stop.offset() << ':' << static_cast<int>(c.r()) <<
+                ',' << static_cast<int>(c.g()) << ',' <<
+                static_cast<int>(c.b()) << ',' << static_cast<int>(c.a());
+        }
+    };
+    switch (paint.type()) {
+        case Paint::Type::linear_gradient: {
+            const auto &g = paint.linear_gradient();
+            s << "linear " << g.x1() << ' ' << g.y1() << ' ' << g.x2() <<
+                ' ' << g.y2();
+            print_ramp_key(g.ramp());
+            break;
+        }
+        case Paint::Type::radial_gradient: {
+            const auto &g = paint.radial_gradient();
+            s << "radial " << g.cx() << ' ' << g.cy() << ' ' << g.fx() <<
+                ' ' << g.fy() << ' ' << g.r();
+            print_ramp_key(g.ramp());
+            break;
+        }
+        case Paint::Type::texture:
+            s << "texture " << &paint.texture().image();
+            break;
+        default:
+            break;
+    }
+    const Xform xf = paint.xf().transformed(shape.xf().inverse());
+    s << " xf";
+    for (int i = 0; i < 2; ++i) {
+        for (int j = 0; j < 3; ++j) s << ' ' << xf[i][j];
+    }
+    return s.str();
+}
+
 
 class SVGPaintedPrinter final: public scene::IScene<SVGPaintedPrinter> {
     util::Indent &m_nl;
     const std::unordered_map<std::string, int> &m_map;
+    const std::vector<int> &m_path_ids;
     const xform::Xform &m_screen_xf;
 	std::ostream &m_out;
-	int m_shape_id, m_clippath_id;
+	int m_shape_id, m_clippath_id, m_element;
     std::vector<int> m_active_clips, m_not_yet_active_clips;
 public:
 	SVGPaintedPrinter(
         util::Indent &nl,
         const std::unordered_map<std::string, int> &map,
+        const std::vector<int> &path_ids,
         const xform::Xform &screen_xf,
         std::ostream &out):
         m_nl(nl),
         m_map(map),
+        m_path_ids(path_ids),
         m_screen_xf(screen_xf),
         m_out(out),
         m_shape_id(0),
-        m_clippath_id(0)
+        m_clippath_id(0),
+        m_element(0)
         { ; }
 
 private:
     using Style = stroke::Style;
 
     void print_paint(const char *mode, const Shape &shape, const Paint &paint) {
-        (void) shape;
         m_out << ' ' << mode << "=\"";
         switch (paint.type()) {
             case Paint::Type::solid_color: {
@@ -182,9 +262,7 @@ private:
             }
             case Paint::Type::linear_gradient:
             case Paint::Type::radial_gradient: {
-                std::ostringstream s;
-                s << &paint;
-                const auto found = m_map.find(s.str());
+                const auto found = m_map.find(paint_key(shape, paint));
                 if (found != m_map.end()) {
                     m_out << "url(#gradient" << found->second << ")";
                     if (paint.opacity() != 255) {
@@ -196,9 +274,7 @@ private:
                 break;
             }
             case Paint::Type::texture: {
-                std::ostringstream s;
-                s << &paint;
-                const auto found = m_map.find(s.str());
+                const auto found = m_map.find(paint_key(shape, paint));
                 if (found != m_map.end()) {
                     m_out << "url(#texture" << found->second << ")";
                     if (paint.opacity() != 255) {
@@ -244,32 +320,24 @@ private:
 
     void do_painted_element(WindingRule wr, const Shape &shape,
         const Paint &paint) {
-        const char *mode = nullptr;
-        const stroke::Style *stroke_style = nullptr;
-        Shape path_shape;
-        xform::Xform pre_xf = xform::Identity();
-        xform::Xform post_xf = shape.xf();
-        if (shape.type() == Shape::Type::stroke &&
-            shape.stroke().style().method() == stroke::Method::driver) {
-            mode = "stroke";
-            stroke_style = &shape.stroke().style();
-            pre_xf = shape.stroke().shape().xf();
-            // convert shape to be stroked into a path
-            path_shape = shape.stroke().shape().as_path_shape(
-                shape.xf().transformed(m_screen_xf));
-        } else {
-            mode = "fill";
-            path_shape = shape.as_path_shape(m_screen_xf);
+        const stroke::Style *stroke_style = driver_stroke_style(shape);
+        const char *mode = stroke_style? "stroke": "fill";
+        // path data shared with other elements is only referenced
+        int path_id = m_path_ids[m_element++];
+        bool shared = path_id >= 0;
+        m_out << m_nl << (shared? "<use": "<path") << " id=\"shape" <<
+            m_shape_id << '"';
+        if (shared) {
+            m_out << " xlink:href=\"#path" << path_id << '"';
         }
-        m_out << m_nl << "<path id=\"shape" << m_shape_id << '"';
         m_out << " fill-rule=\"" << svg_winding_rule_name(wr) << '"';
         if (stroke_style) {
             m_out << " fill=\"none\"";
             print_stroke_style(*stroke_style);
         }
-        print_xform(post_xf, " transform", m_out);
+        print_xform(shape.xf(), " transform", m_out);
         print_paint(mode, shape, paint);
-        print_path_data(path_shape.path(), pre_xf, m_out);
+        if (!shared) print_painted_path_data(shape, m_screen_xf, m_out);
         m_out << "/>";
         ++m_shape_id;
     }
@@ -357,27 +425,37 @@ class SVGPaintStencilPrinter final:
     public scene::IScene<SVGPaintStencilPrinter> {
     util::Indent &m_nl;
     std::unordered_map<std::string, int> &m_map;
+    std::vector<int> &m_path_ids;
     const xform::Xform &m_screen_xf;
 	std::ostream &m_out;
 	int m_blur_id, m_gradient_id, m_texture_id, m_stencil_id, m_clippath_id;
+    int m_path_id;
     Xform m_stencil_xf;
     std::vector<Xform> m_stencil_xf_stack;
     std::vector<int> m_active_clips, m_not_yet_active_clips;
+    // images already written, by the id of the texture holding them
+    std::unordered_map<const image::IImage *, int> m_images;
+    // first painted element with each path data, by the path data, and
+    // the id of the path once another element paints it
+    std::unordered_map<std::string, std::pair<int, int>> m_paths;
 public:
 	SVGPaintStencilPrinter(
         util::Indent &nl,
         std::unordered_map<std::string, int> &map,
+        std::vector<int> &path_ids,
         const xform::Xform &screen_xf,
         std::ostream &out):
         m_nl(nl),
         m_map(map),
+        m_path_ids(path_ids),
         m_screen_xf(screen_xf),
         m_out(out),
         m_blur_id(0),
         m_gradient_id(0),
         m_texture_id(0),
         m_stencil_id(0),
-        m_clippath_id(0)
+        m_clippath_id(0),
+        m_path_id(0)
         { ; }
 
 private:
@@ -416,10 +494,7 @@ private:
     }
 
     void print_linear_gradient(const Shape &shape, const Paint &paint) {
-        (void) shape;
-        std::ostringstream s;
-        s << &paint;
-        auto found = m_map.insert({s.str(), m_gradient_id});
+        auto found = m_map.insert({paint_key(shape, paint), m_gradient_id});
         if (found.second) {
             const auto &linear_gradient = paint.linear_gradient();
             m_out << m_nl << "<linearGradient id=\"gradient" << m_gradient_id <<
@@ -441,10 +516,7 @@ private:
     }
 
     void print_radial_gradient(const Shape &shape, const Paint &paint) {
-        (void) shape;
-        std::ostringstream s;
-        s << &paint;
-        auto found = m_map.insert({s.str(), m_gradient_id});
+        auto found = m_map.insert({paint_key(shape, paint), m_gradient_id});
         if (found.second) {
             const auto &radial_gradient = paint.radial_gradient();
             m_out << m_nl << "<radialGradient id=\"gradient" << m_gradient_id <<
@@ -467,10 +539,7 @@ private:
     }
 
     void print_texture(const Shape &shape, const Paint &paint) {
-        (void) shape;
-        std::ostringstream s;
-        s << &paint;
-        auto found = m_map.insert({s.str(), m_texture_id});
+        auto found = m_map.insert({paint_key(shape, paint), m_texture_id});
         if (found.second) {
             const auto &texture = paint.texture();
             m_out << m_nl++ << "<pattern id=\"texture" << m_texture_id <<
@@ -478,25 +547,53 @@ private:
             print_xform(paint.xf().transformed(shape.xf().inverse()),
                 " patternTransform", m_out);
             m_out << '>';
-            m_out << m_nl << "<image id=\"image" << m_texture_id <<
-                "\" width=\"1\" height=\"1\" preserveAspectRatio=\"none\"" <<
-                " transform=\"scale(1,-1) translate(0,-1)\" xlink:href=\"" <<
-                " data:image/png;base64,\n";
-            std::string simg;
-            if (texture.image().channel_type() == image::ChannelType::channel_uint8_t)
-                rvg::image::pngio::store<uint8_t>(&simg, texture.image_ptr());
-            else
-                rvg::image::pngio::store<uint16_t>(&simg, texture.image_ptr());
-            m_out << rvg::base64::encode(simg) << "\"/>";
+            // an image sampled with another transformation is reused
+            auto written = m_images.insert({&texture.image(), m_texture_id});
+            if (!written.second) {
+                m_out << m_nl << "<use xlink:href=\"#image" <<
+                    written.first->second << "\"/>";
+            } else {
+                m_out << m_nl << "<image id=\"image" << m_texture_id <<
+                    "\" width=\"1\" height=\"1\" preserveAspectRatio=\"none\"" <<
+                    " transform=\"scale(1,-1) translate(0,-1)\" xlink:href=\"" <<
+                    " data:image/png;base64,\n";
+                std::string simg;
+                if (texture.image().channel_type() == image::ChannelType::channel_uint8_t)
+                    rvg::image::pngio::store<uint8_t>(&simg, texture.image_ptr());
+                else
+                    rvg::image::pngio::store<uint16_t>(&simg, texture.image_ptr());
+                m_out << rvg::base64::encode(simg) << "\"/>";
+            }
             m_out << --m_nl << "</pattern>";
             ++m_texture_id;
         }
     }
 
+private:
     friend scene::IScene<SVGPaintStencilPrinter>;
 
     void do_painted_element(WindingRule, const Shape &shape,
         const Paint &paint) {
+        // path data painted by more than one element is written once,
+        // here, and m_path_ids tells SVGPaintedPrinter which elements
+        // reference it. Only identical path data is shared.
+        std::ostringstream s;
+        s.imbue(m_out.getloc());
+        print_painted_path_data(shape, m_screen_xf, s);
+        const std::string d = s.str();
+        int element = static_cast<int>(m_path_ids.size());
+        m_path_ids.push_back(-1);
+        auto found = m_paths.insert({d, {element, -1}});
+        if (!found.second) {
+            auto &first = found.first->second;
+            if (first.second < 0) {
+                first.second = m_path_id++;
+                m_path_ids[first.first] = first.second;
+                m_out << m_nl << "<path id=\"path" << first.second << '"' <<
+                    d << "/>";
+            }
+            m_path_ids[element] = first.second;
+        }
         switch (paint.type()) {
             case Paint::Type::solid_color:
                 break;
@@ -689,6 +786,7 @@ void render(const Accelerated &accel, const Viewport &vp, std::ostream &out,
     std::tie(xl, yb) = vp.bl();
     std::tie(xr, yt) = vp.tr();
     std::unordered_map<std::string, int> map;
+    std::vector<int> path_ids;
     util::Indent nl;
     out << "<?xml version=\"1.0\" standalone=\"no\"?>\n" <<
        "<svg\n" <<
@@ -708,8 +806,9 @@ void render(const Accelerated &accel, const Viewport &vp, std::ostream &out,
     Xform screen_xf = accel.xf().transformed(flip);
     ++nl;
     out << nl++ << "<defs>";
-    // write stencil shape, gradient paints, and textures
-	SVGPaintStencilPrinter psp(nl, map, screen_xf, out);
+    // write stencil shape, gradient paints, textures, and path data
+    // shared by painted shapes
+	SVGPaintStencilPrinter psp(nl, map, path_ids, screen_xf, out);
 	accel.scene().iterate(psp);
     // write clip-paths
 	SVGClipPrinter cp(nl, map, screen_xf, out);
@@ -722,7 +821,7 @@ void render(const Accelerated &accel, const Viewport &vp, std::ostream &out,
     print_xform(accel.xf(), " transform", out);
     out << "> <!-- window-viewport -->";
     // write painted shapes
-	SVGPaintedPrinter pp(nl, map, screen_xf, out);
+	SVGPaintedPrinter pp(nl, map, path_ids, screen_xf, out);
 	accel.scene().iterate(pp);
     out << --nl << "</g>";
     out << --nl << "</g>";
@@ -744,9 +843,14 @@ static int luarender(lua_State *L) {
     auto accel = rvg::description::lua::checkxformablescene(L, 1);
     auto vp = rvg::description::lua::checkviewport(L, 2);
     FILE *f = compat_check_file(L, 3);
-    std::ostringstream sout;
-    rvg::driver::svg::render(accel, vp, sout);
-    fwrite(sout.str().data(), 1, sout.str().size(), f);
+    bool failed = false;
+    {
+        rvg::driver::FileStream out(f);
+        rvg::driver::svg::render(accel, vp, out);
+        out.flush();
+        failed = !out || fflush(f) != 0;
+    }
+    if (failed) return luaL_error(L, "unable to write svg");
     return 0;
 }
 
@@ -0,0 +1,183 @@
+#ifndef RVG_DRIVER_PNG_TEXTURE_H
+#define RVG_DRIVER_PNG_TEXTURE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "driver/cpp/png.h"
+#include "driver/cpp/packet.h"
+
+namespace rvg {
+    namespace driver {
+        namespace png {
+
+// Textures are stored as a mip pyramid: level 0 is the image itself, and
+// each level after it halves the one before, down to a single texel.
+// Levels follow each other in the texel array.
+
+inline int32_t mip_width(const Texture &tex, int level) {
+    return std::max(1, tex.width >> level);
+}
+
+inline int32_t mip_height(const Texture &tex, int level) {
+    return std::max(1, tex.height >> level);
+}
+
+// Number of levels down to a single texel
+inline int32_t mip_levels(int32_t width, int32_t height) {
+    int32_t levels = 1;
+    while ((width >> (levels-1)) > 1 || (height >> (levels-1)) > 1) {
+        ++levels;
+    }
+    return levels;
+}
+
+// Offset of the first float of a level, relative to Texture::first_texel
+inline uint64_t mip_offset(const Texture &tex, int level) {
+    uint64_t offset = 0;
+    for (int l = 0; l < level; ++l) {
+        offset += 4*static_cast<uint64_t>(mip_width(tex, l))*
+            static_cast<uint64_t>(mip_height(tex, l));
+    }
+    return offset;
+}
+
+// Appends levels 1 and beyond to texels, each the 2x2 box filtered
+// version of the level before. Level 0 must already be in place.
+inline void build_mipmaps(const Texture &tex, std::vector<float> &texels) {
+    for (int l = 1; l < tex.levels; ++l) {
+        int32_t pw = mip_width(tex, l-1), ph = mip_height(tex, l-1);
+        int32_t w = mip_width(tex, l), h = mip_height(tex, l);
+        uint64_t prev = tex.first_texel + mip_offset(tex, l-1);
+        texels.resize(tex.first_texel + mip_offset(tex, l) +
+            4*static_cast<uint64_t>(w)*static_cast<uint64_t>(h));
+        float *out = texels.data() + tex.first_texel + mip_offset(tex, l);
+        const float *in = texels.data() + prev;
+        for (int32_t j = 0; j < h; ++j) {
+            int32_t j0 = std::min(2*j, ph-1), j1 = std::min(2*j+1, ph-1);
+            for (int32_t i = 0; i < w; ++i) {
+                int32_t i0 = std::min(2*i, pw-1), i1 = std::min(2*i+1, pw-1);
+                for (int k = 0; k < 4; ++k) {
+                    *out++ = .25f*(in[4*(j0*pw+i0)+k] + in[4*(j0*pw+i1)+k] +
+                        in[4*(j1*pw+i0)+k] + in[4*(j1*pw+i1)+k]);
+                }
+            }
+        }
+    }
+}
+
+// Level of detail for a texture seen through an affine screen to paint
+// transformation ixf: log2 of the number of texels one pixel spans
+inline float texture_lod(const Texture &tex, const float ixf[6]) {
+    float w = static_cast<float>(tex.width);
+    float h = static_cast<float>(tex.height);
+    float dx = std::hypot(ixf[0]*w, ixf[3]*h);
+    float dy = std::hypot(ixf[1]*w, ixf[4]*h);
+    float rho = std::max(dx, dy);
+    return rho > 0.f? std::log2(rho): 0.f;
+}
+
+namespace detail {
+
+// The four texels around texel coordinates x, y, and the weights between
+// them. Texel centers are at half integers, and edges are clamped.
+struct Taps {
+    int32_t i0, i1, j0, j1;
+    float s, t;
+};
+
+inline Taps taps(int32_t w, int32_t h, float x, float y) {
+    x -= .5f; y -= .5f;
+    float fx = std::floor(x), fy = std::floor(y);
+    // keep far away coordinates from overflowing the conversion
+    int32_t ix = static_cast<int32_t>(std::min(std::max(fx, -1.f),
+        static_cast<float>(w)));
+    int32_t iy = static_cast<int32_t>(std::min(std::max(fy, -1.f),
+        static_cast<float>(h)));
+    return Taps{std::min(std::max(ix, 0), w-1),
+        std::min(std::max(ix+1, 0), w-1),
+        std::min(std::max(iy, 0), h-1),
+        std::min(std::max(iy+1, 0), h-1),
+        x - fx, y - fy};
+}
+
+#ifdef RVG_DRIVER_PNG_VECTOR
+using Texel = vfloat4;
+
+// All four channels at once, straight from the texel array
+inline void bilinear(const float *level, int32_t w, int32_t h, float x,
+    float y, Texel &out) {
+    Taps p = taps(w, h, x, y);
+    Texel c00, c10, c01, c11;
+    std::memcpy(&c00, level + 4*(p.j0*w + p.i0), sizeof(c00));
+    std::memcpy(&c10, level + 4*(p.j0*w + p.i1), sizeof(c10));
+    std::memcpy(&c01, level + 4*(p.j1*w + p.i0), sizeof(c01));
+    std::memcpy(&c11, level + 4*(p.j1*w + p.i1), sizeof(c11));
+    Texel b0 = c00 + p.s*(c10 - c00);
+    Texel b1 = c01 + p.s*(c11 - c01);
+    out = b0 + p.t*(b1 - b0);
+}
+
+inline void lerp(Texel &c, const Texel &c1, float f) {
+    c += f*(c1 - c);
+}
+#else
+struct Texel {
+    float c[4];
+    float operator[](int k) const { return c[k]; }
+};
+
+inline void bilinear(const float *level, int32_t w, int32_t h, float x,
+    float y, Texel &out) {
+    Taps p = taps(w, h, x, y);
+    const float *c00 = level + 4*(p.j0*w + p.i0);
+    const float *c10 = level + 4*(p.j0*w + p.i1);
+    const float *c01 = level + 4*(p.j1*w + p.i0);
+    const float *c11 = level + 4*(p.j1*w + p.i1);
+    for (int k = 0; k < 4; ++k) {
+        float b0 = c00[k] + p.s*(c10[k] - c00[k]);
+        float b1 = c01[k] + p.s*(c11[k] - c01[k]);
+        out.c[k] = b0 + p.t*(b1 - b0);
+    }
+}
+
+inline void lerp(Texel &c, const Texel &c1, float f) {
+    for (int k = 0; k < 4; ++k) c.c[k] += f*(c1.c[k] - c.c[k]);
+}
+#endif
+
+} // namespace detail
+
+// Samples the texture at u, v in [0,1]. Magnified textures are
+// interpolated bilinearly, minified ones trilinearly between the two
+// levels nearest to lod.
+inline void sample_texture(const Texture &tex, const float *texels,
+    float u, float v, float lod, float &r, float &g, float &b, float &a) {
+    const float *base = texels + tex.first_texel;
+    int l0 = 0, l1 = 0;
+    float f = 0.f;
+    if (lod > 0.f) {
+        float top = static_cast<float>(tex.levels-1);
+        lod = std::min(lod, top);
+        l0 = static_cast<int>(lod);
+        l1 = std::min(l0+1, tex.levels-1);
+        f = lod - static_cast<float>(l0);
+    }
+    int32_t w0 = mip_width(tex, l0), h0 = mip_height(tex, l0);
+    detail::Texel c;
+    detail::bilinear(base + mip_offset(tex, l0), w0, h0, u*w0, v*h0, c);
+    if (f > 0.f) {
+        int32_t w1 = mip_width(tex, l1), h1 = mip_height(tex, l1);
+        detail::Texel c1;
+        detail::bilinear(base + mip_offset(tex, l1), w1, h1, u*w1, v*h1, c1);
+        detail::lerp(c, c1, f);
+    }
+    r = c[0]; g = c[1]; b = c[2]; a = c[3];
+}
+
+} } } // namespace rvg::driver::png
+
+#endif
@@ -0,0 +1,210 @@
+#ifndef RVG_DRIVER_PNG_THREAD_POOL_H
+#define RVG_DRIVER_PNG_THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace rvg {
+    namespace driver {
+        namespace png {
+
+// Number of threads to use when the user does not say otherwise
+inline int default_thread_count(void) {
+    unsigned n = std::thread::hardware_concurrency();
+    return n > 0? static_cast<int>(n): 1;
+}
+
+// Threads kept waiting for tasks for as long as the program runs, so that
+// callers need not start threads each time they have work to share.
+// Tasks are posted in batches. Finishing a batch drops the tasks no
+// thread has taken yet and waits for the others to return. Threads that
+// post and finish batches of their own from inside a task never wait
+// for tasks that are not running, so nesting cannot deadlock.
+class ThreadPool {
+public:
+    class Batch {
+        friend ThreadPool;
+        int m_running = 0;      // tasks taken by some thread
+    };
+
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_wake, m_done;
+    std::deque<std::pair<Batch *, std::function<void()>>> m_tasks;
+    std::vector<std::thread> m_threads;
+    bool m_quit;
+
+    void run(void) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for ( ;; ) {
+            m_wake.wait(lock, [this]() {
+                return m_quit || !m_tasks.empty();
+            });
+            if (m_tasks.empty()) return;
+            Batch *batch = m_tasks.front().first;
+            std::function<void()> task = std::move(m_tasks.front().second);
+            m_tasks.pop_front();
+            ++batch->m_running;
+            lock.unlock();
+            task();
+            lock.lock();
+            --batch->m_running;
+            m_done.notify_all();
+        }
+    }
+
+public:
+    ThreadPool(void): m_quit(false) { ; }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_quit = true;
+        }
+        m_wake.notify_all();
+        for (auto &thread: m_threads) {
+            thread.join();
+        }
+    }
+
+    // Starts threads until there are at least n, or no more can start
+    void reserve(int n) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        try {
+            while (static_cast<int>(m_threads.size()) < n) {
+                m_threads.emplace_back(&ThreadPool::run, this);
+            }
+        } catch (...) {
+            // the threads already there will have to do
+        }
+    }
+
+    // Queues task, which must not throw, as part of batch
+    void post(Batch &batch, std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_tasks.emplace_back(&batch, std::move(task));
+        }
+        m_wake.notify_one();
+    }
+
+    // Drops the tasks of batch no thread has taken, and waits for the
+    // ones that were taken to return
+    void finish(Batch &batch) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_tasks.erase(std::remove_if(m_tasks.begin(), m_tasks.end(),
+            [&batch](const std::pair<Batch *, std::function<void()>> &t) {
+                return t.first == &batch;
+            }), m_tasks.end());
+        m_done.wait(lock, [&batch]() { return batch.m_running == 0; });
+    }
+};
+
+// Pool shared by every call to parallel_for
+inline ThreadPool &thread_pool(void) {
+    static ThreadPool pool;
+    return pool;
+}
+
+// Runs f(i) for every i in [0,n) using n_threads threads (the calling
+// thread included). Each thread starts with a contiguous block of
+// indices and consumes it from the front. A thread that runs out of
+// work steals the back half of the block of some other thread.
+// The first exception thrown by f stops all threads from taking more
+// work, and is rethrown once they have all returned.
+// The other threads come from thread_pool(), so calls per tree level or
+// per band cost a wake-up, not a thread start. The calling thread alone
+// can do all the work, so helpers that never get a thread are dropped.
+template <typename F>
+void parallel_for(int n, int n_threads, F &&f) {
+    n_threads = std::max(1, std::min(n_threads, n));
+    if (n_threads <= 1) {
+        for (int i = 0; i < n; ++i) f(i);
+        return;
+    }
+    struct Block {
+        std::mutex mutex;
+        int begin, end;
+    };
+    std::unique_ptr<Block[]> blocks(new Block[n_threads]);
+    for (int t = 0; t < n_threads; ++t) {
+        long long nn = n;
+        blocks[t].begin = static_cast<int>(nn*t/n_threads);
+        blocks[t].end = static_cast<int>(nn*(t+1)/n_threads);
+    }
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    std::atomic<bool> stop(false);
+    auto fail = [&]() {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!error) error = std::current_exception();
+        stop = true;
+    };
+    auto work = [&blocks, &f, &stop, n_threads](int t) {
+        Block &own = blocks[t];
+        while (!stop) {
+            int i = -1;
+            {
+                std::lock_guard<std::mutex> lock(own.mutex);
+                if (own.begin < own.end) i = own.begin++;
+            }
+            if (i >= 0) {
+                f(i);
+                continue;
+            }
+            // look for a victim, starting from the next thread over
+            int begin = 0, end = 0;
+            for (int k = 1; k < n_threads && begin >= end; ++k) {
+                Block &victim = blocks[(t+k) % n_threads];
+                std::lock_guard<std::mutex> lock(victim.mutex);
+                int left = victim.end - victim.begin;
+                if (left > 0) {
+                    end = victim.end;
+                    begin = victim.end - (left+1)/2;
+                    victim.end = begin;
+                }
+            }
+            // nothing left anywhere: threads still holding work finish it
+            if (begin >= end) return;
+            std::lock_guard<std::mutex> lock(own.mutex);
+            own.begin = begin;
+            own.end = end;
+        }
+    };
+    auto worker = [&work, &fail](int t) {
+        try {
+            work(t);
+        } catch (...) {
+            fail();
+        }
+    };
+    ThreadPool &pool = thread_pool();
+    pool.reserve(n_threads-1);
+    ThreadPool::Batch batch;
+    try {
+        for (int t = 1; t < n_threads; ++t) {
+            pool.post(batch, [&worker, t]() { worker(t); });
+        }
+    } catch (...) {
+        // could not post them all: those that were posted will do
+    }
+    worker(0);
+    pool.finish(batch);
+    if (error) std::rethrow_exception(error);
+}
+
+} } } // namespace rvg::driver::png
+
+#endif
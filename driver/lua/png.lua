@@ -723,11 +723,35 @@ local function createBoundingBox(bb, read)
   return xmin,ymin,xmax,ymax
 end
 
+-- Position of the weight of each type of segment in the -cost option
+local costindex = {
+  linear_segment = 1,
+  end_open_contour = 1,
+  end_closed_contour = 1,
+  quadratic_segment = 2,
+  rational_quadratic_segment = 3,
+  cubic_segment = 4,
+}
+
 -- Função que diferencia scenes como branches ou leafs
 -- LEMBRAR DE USÁ-LA NO SAMPLE
-function isLeaf(tree, ind, maxdepth, maxseg)
-  if 1 < tree[ind].segments and tree[ind].depth < maxdepth then return false
-  else return true end
+-- A cell is split while its sampling cost, the number of samples that
+-- fall in it times the weighted number of segments each of them tests,
+-- exceeds maxcost
+function isLeaf(scene, tree, ind, params)
+  local cell = tree[ind]
+  if cell.segments <= params.maxseg or cell.depth >= params.maxdepth then
+    return true
+  end
+  local weight = 0
+  for k, segments in pairs(cell.data) do
+    local instructions = scene.shapes[k].instructions
+    for index, segment_num in pairs(segments) do
+      weight = weight + params.cost[costindex[instructions[segment_num]] or 1]
+    end
+  end
+  local xmin, ymin, xmax, ymax = unpack(cell.boundingBox)
+  return (xmax-xmin)*(ymax-ymin)*params.spp*weight <= params.maxcost
 end
 
 function insidetest_linear(x0,y0,x1,y1,xmin,ymin,xmax,ymax)
@@ -1066,7 +1090,7 @@ function LoadShortcuts(scene, tree, fatherInd, ind)
   end
 end
 
-function subdivide(scene, tree, fatherInd, maxdepth, maxseg)
+function subdivide(scene, tree, fatherInd, params)
   for i=4,1,-1 do
     local ind = fatherInd .. i
 
@@ -1085,11 +1109,11 @@ function subdivide(scene, tree, fatherInd, maxdepth, maxseg)
 
     fillData(scene, tree, fatherInd, ind) -- FUTURE OPTIMIZATION: SAME LOOP
     tree[ind].shortcuts = CreateShortcuts(scene, tree[ind].data, tree[ind].boundingBox, ind)
-      if isLeaf(tree, ind, maxdepth, maxseg) == true then
+      if isLeaf(scene, tree, ind, params) == true then
       tree[ind].leaf = true
     else
       tree[ind].leaf = false
-      subdivide(scene, tree, ind, maxdepth, maxseg)
+      subdivide(scene, tree, ind, params)
     end
   end
 end
@@ -1117,6 +1141,137 @@ function initializeTree(new_scene, viewport)
     return tree
 end
 
+-- Parses numbers, or first:last[:step] ranges, separated by commas, as
+-- the C++ driver does
+local function parselist(all, l)
+    local values = {}
+    for item in string.gmatch(l, "[^,]+") do
+        local f = {}
+        for w in string.gmatch(item, "[^:]+") do
+            f[#f+1] = assert(tonumber(w), "number invalid option " .. all)
+        end
+        assert(#f >= 1 and #f <= 3, "count invalid option " .. all)
+        if #f == 1 then
+            values[#values+1] = f[1]
+        else
+            local first, last = f[1], f[2]
+            local step = f[3] or (last >= first and 1 or -1)
+            local n = step ~= 0 and (last-first)/step or -1
+            assert(n >= 0 and n <= 1e6, "range invalid option " .. all)
+            for i = 0, floor(n + 1e-4) do
+                values[#values+1] = first + i*step
+            end
+        end
+    end
+    assert(#values > 0, "empty invalid option " .. all)
+    return values
+end
+
+local function parseargs(args)
+    local parsed = {
+        pattern = blue[1],
+        tx = {0},
+        ty = {0},
+        frames = nil,
+        p = nil,
+        dumpcellsprefix = nil,
+        maxdepth = 10,
+        maxseg = 4,
+        maxcost = 1024,
+        cost = {1, 2, 3, 4},
+    }
+    -- Available options
+    local options = {
+        -- Selects a supersampling pattern
+        { "^(%-pattern:(%d+)(.*))$", function(all, n, e)
+            if not n then return false end
+            assert(e == "", "trail invalid option " .. all)
+            n = assert(tonumber(n), "number invalid option " .. all)
+            assert(blue[n], "non exist invalid option " .. all)
+            parsed.pattern = blue[n]
+            return true
+        end },
+        -- Select a single path for rendering
+        { "^(%-p:(%d+)(.*))$", function(all, n, e)
+            if not n then return false end
+            assert(e == "", "trail invalid option " .. all)
+            parsed.p = assert(tonumber(n), "number invalid option " .. all)
+            return true
+        end },
+        -- Translates scene by tx,ty pixels before rendering, once per
+        -- value in lists and ranges, as in -tx:0,5 or -tx:0:10:2
+        { "^(%-tx:(.+))$", function(all, l)
+            if not l then return false end
+            parsed.tx = parselist(all, l)
+            return true
+        end },
+        { "^(%-ty:(.+))$", function(all, l)
+            if not l then return false end
+            parsed.ty = parselist(all, l)
+            return true
+        end },
+        -- Output file of each frame, with %x and %y replaced by its
+        -- translation
+        { "^%-frames:(.+)$", function(n)
+            if not n then return false end
+            parsed.frames = n
+            return true
+        end },
+        -- Cells at this depth are never subdivided
+        { "^(%-maxdepth:(%d+)(.*))$", function(all, n, e)
+            if not n then return false end
+            assert(e == "", "trail invalid option " .. all)
+            parsed.maxdepth = assert(tonumber(n), "number invalid option " .. all)
+            return true
+        end },
+        -- Cells with this many segments or fewer are never subdivided
+        { "^(%-maxseg:(%d+)(.*))$", function(all, n, e)
+            if not n then return false end
+            assert(e == "", "trail invalid option " .. all)
+            parsed.maxseg = assert(tonumber(n), "number invalid option " .. all)
+            return true
+        end },
+        -- Cells are subdivided while their sampling cost exceeds this
+        { "^(%-maxcost:([%d%.]+)(.*))$", function(all, n, e)
+            if not n then return false end
+            assert(e == "", "trail invalid option " .. all)
+            parsed.maxcost = assert(tonumber(n), "number invalid option " .. all)
+            return true
+        end },
+        -- Cost of linear, quadratic, rational quadratic and cubic segments
+        { "^(%-cost:(.*))$", function(all, l)
+            if not l then return false end
+            local cost = {}
+            for w in string.gmatch(l, "[^,]+") do
+                cost[#cost+1] = assert(tonumber(w), "number invalid option " .. all)
+            end
+            assert(#cost == 4, "count invalid option " .. all)
+            parsed.cost = cost
+            return true
+        end },
+        -- Dump cells matching a given prefix
+        { "^%-dumpcells:(.*)$", function(n)
+            if not n then return false end
+            parsed.dumpcellsprefix = n
+            return true
+        end },
+        -- Catch all unrecognized options and throw error
+        { ".*", function(all)
+            error("unrecognized option " .. all)
+        end }
+    }
+    -- Process options
+    for i, arg in ipairs(args) do
+        for j, option in ipairs(options) do
+            if option[2](arg:match(option[1])) then
+                break
+            end
+        end
+    end
+    -- Return parsed values
+    return parsed
+end
+
 -----------------------------------------
 --[[		ACCELERATE FUNCTION 	 ]]--
 -----------------------------------------
@@ -1133,7 +1288,10 @@ function applyWindingNumber(test, winding_rule, y0, y1)
 	return 0
 end
 
-function _M.accelerate(scene, viewport)
+function _M.accelerate(scene, viewport, args)
+    local params = parseargs(args or {})
+    -- samples taken per pixel, for the cost of each cell
+    params.spp = #params.pattern/2
 
 	local new_scene = scene
 
@@ -1443,7 +1601,7 @@ function _M.accelerate(scene, viewport)
     end
 
     local tree = initializeTree(new_scene, viewport)
-    subdivide(new_scene,tree,"0",1,100)
+    subdivide(new_scene,tree,"0",params)
 
    	-- UNIT TEST - TREE[IND].DATA FILLING:
     -- print("Test subdivision: ")
@@ -1894,76 +2052,13 @@ local function supersample(accel, pattern, x, y, path_num, kernel)
     return gamma_correction(sr,sg,sb,sa,W)
 end
 
-local function parseargs(args)
-    local parsed = {
-        pattern = blue[1],
-        tx = 0,
-        ty = 0,
-        p = nil,
-        dumpcellsprefix = nil,
-    }
-    -- Available options
-    local options = {
-        -- Selects a supersampling pattern
-        { "^(%-pattern:(%d+)(.*))$", function(all, n, e)
-            if not n then return false end
-            assert(e == "", "trail invalid option " .. all)
-            n = assert(tonumber(n), "number invalid option " .. all)
-            assert(blue[n], "non exist invalid option " .. all)
-            parsed.pattern = blue[n]
-            return true
-        end },
-        -- Select a single path for rendering
-        { "^(%-p:(%d+)(.*))$", function(all, n, e)
-            if not n then return false end
-            assert(e == "", "trail invalid option " .. all)
-            parsed.p = assert(tonumber(n), "number invalid option " .. all)
-            return true
-        end },
-        -- Translates scene by tx,ty pixels before rendering
-        { "^(%-tx:(%-?%d+)(.*))$", function(all, n, e)
-            if not n then return false end
-            assert(e == "", "trail invalid option " .. all)
-            parsed.tx = assert(tonumber(n), "number invalid option " .. all)
-            return true
-        end },
-        { "^(%-ty:(%-?%d+)(.*))$", function(all, n, e)
-            if not n then return false end
-            assert(e == "", "trail invalid option " .. all)
-            parsed.ty = assert(tonumber(n), "number invalid option " .. all)
-            return true
-        end },
-        -- Dump cells matching a given prefix
-        { "^%-dumpcells:(.*)$", function(n)
-            if not n then return false end
-            parsed.dumpcellsprefix = n
-            return true
-        end },
-        -- Catch all unrecognized options and throw error
-        { ".*", function(all)
-            error("unrecognized option " .. all)
-        end }
-    }
-    -- Process options
-    for i, arg in ipairs(args) do
-        for j, option in ipairs(options) do
-            if option[2](arg:match(option[1])) then
-                break
-            end
-        end
-    end
-    -- Return parsed values
-    return parsed
-end
-
 -- In theory, you don't have to change this function.
 -- It simply allocates the image, samples each pixel center,
 -- and saves the image into the file.
-function _M.render(scene, viewport, file, args)
-    parsed = parseargs(args)
+-- Renders the scene translated by tx, ty into file
+local function renderframe(scene, viewport, file, tx, ty)
     local pattern = parsed.pattern
     local p = parsed.p
-    local tx, ty = parsed.tx, parsed.ty
     -- Get viewport
       local vxmin, vymin, vxmax, vymax = unpack(viewport, 1, 4)
       if tx ~= nil then
@@ -1994,7 +2089,30 @@ function _M.render(scene, viewport, file, args)
         -- store output image
         image.png.store8(file, img)
     stderr("saved in %.3fs\n", time:elapsed())
+end
+
+-- Renders one frame per combination of the translations in -tx and -ty.
+-- A single frame goes to file. Several frames need -frames:<pattern>,
+-- and each goes to its own file, all sampled from the same accel.
+function _M.render(scene, viewport, file, args)
+    parsed = parseargs(args)
+    assert(#parsed.tx*#parsed.ty == 1 or parsed.frames,
+        "multiple translations need -frames")
+    for _, tx in ipairs(parsed.tx) do
+        for _, ty in ipairs(parsed.ty) do
+            if parsed.frames then
+                local name = string.gsub(parsed.frames, "%%([xy])",
+                    function(c)
+                        return string.format("%g", c == "x" and tx or ty)
+                    end)
+                local f = assert(io.open(name, "wb"))
+                renderframe(scene, viewport, f, tx, ty)
+                f:close()
+            else
+                renderframe(scene, viewport, file, tx, ty)
+            end
+        end
     end
-  --end
+end
 
 return _M
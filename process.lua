@@ -31,6 +31,8 @@ end
 local width, height
 -- locals for driver, input, and output
 local drivername, inputname, outputname, profilename, pngs
+-- legacy frame ranges, by axis
+local legacy = {}
 
 -- list of supported options
 -- in each option,
@@ -88,14 +90,6 @@ local nvalues = 0
 -- collect values into another list
 for i, argument in ipairs({...}) do
     if argument:sub(1,1) == "-" then
-        print(argument)
-         pngstart = argument:sub(4,4)
-         local i = 5
-         while argument:sub(i,i) ~= "-" and i <= string.len(argument) do
-            pngstart = pngstart .. argument:sub(i,i)
-            i = i + 1
-        end
-        pngend = argument:sub(i+1,string.len(argument))
         local recognized = false
         for j, option in ipairs(options) do
             if option[2](argument:match(option[1])) then
@@ -106,6 +100,20 @@ for i, argument in ipairs({...}) do
         if not recognized then
             nrejected = nrejected + 1
             rejected[nrejected] = argument
+            -- legacy frame ranges, as in -tx:1-10, render one file per frame
+            local name, first, last =
+                argument:match("^%-t([xy])%:(%d+)%-(%d+)$")
+            if name then
+                assert(not legacy[name], "more than one legacy range for " ..
+                    name .. " in " .. argument)
+                legacy[name] = { index = nrejected, first = first,
+                    last = last }
+            else
+                -- a dash right after a digit is a range the drivers do not
+                -- take, and that cannot be converted to one they do
+                assert(not argument:match("^%-t[xy]%:.*%d%-"),
+                    "invalid legacy range " .. argument)
+            end
         end
     else
         nvalues = nvalues + 1
@@ -115,8 +123,29 @@ end
 drivername = values[1]
 inputname = values[2]
 outputname = values[3]
-local pngstart = tonumber(pngstart)
-local pngend = tonumber(pngend)
+-- legacy ranges become the ranges the drivers take, and the frames are
+-- named after the output file, with the translation along each axis
+-- with a range added to its name before the extension
+if legacy.x or legacy.y then
+    assert(outputname, "legacy frame ranges need an output file")
+    for _, v in ipairs(rejected) do
+        assert(not v:match("^%-frames%:"),
+            "legacy frame ranges cannot be combined with " .. v)
+    end
+    local stem, extension = outputname:match("^(.*)(%.[^%./\\]*)$")
+    if not stem then stem, extension = outputname, "" end
+    for _, name in ipairs{"x", "y"} do
+        local range = legacy[name]
+        if range then
+            rejected[range.index] = string.format("-t%s:%s:%s", name,
+                range.first, range.last)
+            stem = stem .. "-" .. name .. "%" .. name
+        end
+    end
+    nrejected = nrejected + 1
+    rejected[nrejected] = "-frames:" .. stem .. extension
+    outputname = nil
+end
 -- load driver
 assert(drivername, "missing <driver> argument")
 local driver = require(drivername)
@@ -183,33 +212,23 @@ end
 -- pass rejected options as last argument
 time:reset()
 local accel = driver.accelerate(scene, viewport, rejected)
-if pngstart == nil then pngstart = 1 end
-if pngend == nil then pngend = 1 end
-
--- print("pngstart pngend: ", pngstart, pngend)
-
-for i=pngstart,pngend do
-    if i == pngstart then outputname = outputname:sub(1,1) .. i .. outputname:sub(string.len(outputname)-3,string.len(outputname))
-    else outputname = outputname:sub(1,1) .. i .. outputname:sub(string.len(outputname)-3,string.len(outputname)) end
-    -- print("Output name: ", outputname)
-    local output = io.stdout
-    if outputname then
-        output = assert(io.open(outputname, "wb"))
-    end
+stderr("accelerate in %gs\n", time:elapsed())
 
-    if rejected[1] ~= nil then rejected[1] = rejected[1]:sub(1,3) .. tostring(i) end
-    stderr("accelerate in %gs\n", time:elapsed())
-    -- invoke driver-defined render() on result of accelerate()
-    -- pass rejected options as last argument
-    driver.render(accel, viewport, output, rejected)
+local output = io.stdout
+if outputname then
+    output = assert(io.open(outputname, "wb"))
+end
 
-    if profilename then
-        stderr("writing profile results into '%s'\n", profilename)
-        prof:finish()
-        prof:write_results(profilename)
-    end
+-- invoke driver-defined render() on result of accelerate()
+-- pass rejected options as last argument
+driver.render(accel, viewport, output, rejected)
+
+if profilename then
+    stderr("writing profile results into '%s'\n", profilename)
+    prof:finish()
+    prof:write_results(profilename)
+end
 
-    -- close output file if we created it
-    stderr("done in %gs\n", total:elapsed())  
-    if outputname then output:close() end  
-end
\ No newline at end of file
+-- close output file if we created it
+stderr("done in %gs\n", total:elapsed())
+if outputname then output:close() end
@@ -0,0 +1,35 @@
+# Bash script checking that translated copies of a stroke share its outline
+#!/bin/bash
+
+# The same stroke is painted four times, each time translated.
+# Only the first copy must be outlined; the others reuse its outline.
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cat > $dir/strokes.rvg <<'RVG'
+local rvg = {}
+
+local wave = path{M,4,8,C,12,24,20,-8,28,8}:stroked(2)
+
+rvg.scene = scene{
+  fill(wave, rgb8(0,0,0)),
+  fill(wave:translated(30,0), rgb8(0,0,0)),
+  fill(wave:translated(0,30), rgb8(0,0,0)),
+  fill(wave:translated(30,30), rgb8(0,0,0)),
+}
+
+rvg.window = window(0,0,64,64)
+
+rvg.viewport = viewport(0,0,64,64)
+
+return rvg
+RVG
+
+log=$(lua process.lua -quiet driver.cpp.png $dir/strokes.rvg \
+    $dir/strokes.png 2>&1)
+if echo "$log" | grep -q "outlined 1 strokes, reused 3"; then
+    echo "stroke cache: ok"
+else
+    echo "stroke cache: translated strokes were outlined again"
+    echo "$log"
+    exit 1
+fi
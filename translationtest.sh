@@ -12,15 +12,11 @@ ystart=0
 #xstart=$3
 #ystart=$4
 
-xtvals=$(seq $xstart $xsteps)
-ytvals=$(seq $ystart $ysteps)
-
-
-for tx in $xtvals; do
-  for ty in $ytvals; do
-    for input in $RVG; do
-        output=${input%.*}'-x'$tx'-y'$ty.png
-        lua process.lua driver.lua.png $input $output -tx:$tx -ty:$ty 
-    done
-  done
+# The scene is accelerated once and every translated frame is rendered
+# from it, each into its own file, by both png drivers
+for input in $RVG; do
+    frames=${input%.*}'-lua-x%x-y%y.png'
+    lua process.lua driver.lua.png $input -tx:$xstart:$xsteps -ty:$ystart:$ysteps -frames:$frames
+    frames=${input%.*}'-cpp-x%x-y%y.png'
+    lua process.lua driver.cpp.png $input -tx:$xstart:$xsteps -ty:$ystart:$ysteps -frames:$frames
 done